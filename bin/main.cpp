@@ -200,11 +200,203 @@
 //    return 0;
 //}
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/exceptions.h"
 #include "src/parser.h"
+#include "src/vm.h"
+
+namespace {
+    namespace fs = std::filesystem;
+
+    struct JobResult {
+        bool ok = false;
+        std::string error;
+        double wall_ms = 0;
+        uint64_t instructions = 0;
+        heap::GcStats gc{};
+        size_t live_objects = 0;
+        double fragmentation = 0;
+    };
+
+    // Compiles and runs one script in vm, which is reset first
+    JobResult run_script(interpreter::VMData &vm, const std::string &path) {
+        JobResult res;
+        const auto start = std::chrono::steady_clock::now();
+        try {
+            interpreter::reset(vm);
+            std::ifstream fin(path);
+            if (!fin) throw std::runtime_error("cannot open " + path);
+            interpreter::BytecodeEmitter emitter;
+            parser::init_parser(fin, &emitter, vm);
+            parser::parse_program(vm);
+            if (!parser::get_errors().empty()) throw std::runtime_error(parser::get_errors().front());
+            interpreter::run(vm);
+            res.ok = true;
+        } catch (std::exception &e) {
+            res.error = e.what();
+        }
+        res.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        res.instructions = vm.instructions;
+        res.gc = vm.gc.stats;
+        res.live_objects = vm.gc.live_objects();
+        res.fragmentation = vm.gc.cage.fragmentation();
+        return res;
+    }
+
+    std::string json_string(const std::string &s) {
+        std::string res = "\"";
+        for (const char c: s) {
+            if (c == '"' || c == '\\') {
+                res += '\\';
+                res += c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                res += buf;
+            } else {
+                res += c;
+            }
+        }
+        return res + "\"";
+    }
 
-#include "src/value.h"
+    std::string to_json(const std::string &file, const JobResult &res) {
+        std::string line = "{\"file\":" + json_string(file) +
+                           ",\"ok\":" + (res.ok ? "true" : "false") +
+                           ",\"wall_ms\":" + std::to_string(res.wall_ms) +
+                           ",\"instructions\":" + std::to_string(res.instructions) +
+                           ",\"gc_minor\":" + std::to_string(res.gc.minor) +
+                           ",\"gc_major\":" + std::to_string(res.gc.major) +
+                           ",\"gc_large\":" + std::to_string(res.gc.large) +
+                           ",\"gc_compactions\":" + std::to_string(res.gc.compactions) +
+                           ",\"gc_mark_steps\":" + std::to_string(res.gc.mark_steps) +
+                           ",\"gc_max_step_us\":" + std::to_string(res.gc.max_step_us) +
+                           ",\"live_objects\":" + std::to_string(res.live_objects) +
+                           ",\"fragmentation\":" + std::to_string(res.fragmentation);
+        if (!res.ok) line += ",\"error\":" + json_string(res.error);
+        return line + "}";
+    }
+
+    // .ct files under a directory, or the paths listed in a manifest (one per line, relative to it, # comments)
+    std::vector<std::string> collect_scripts(const fs::path &source) {
+        std::vector<std::string> files;
+        if (fs::is_directory(source)) {
+            for (auto &entry: fs::recursive_directory_iterator(source)) {
+                if (entry.is_regular_file() && entry.path().extension() == ".ct")
+                    files.push_back(entry.path().string());
+            }
+            std::sort(files.begin(), files.end());
+            return files;
+        }
+        std::ifstream manifest(source);
+        if (!manifest) throw std::runtime_error("cannot open " + source.string());
+        for (std::string line; std::getline(manifest, line);) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            const fs::path path(line);
+            files.push_back(path.is_absolute() ? line : (source.parent_path() / path).string());
+        }
+        return files;
+    }
+
+    // Runs the scripts on jobs worker threads, each with one VM reused for all its scripts.
+    // gc_pause_us >= 0 makes the collectors incremental with that pause budget, gc_threads > 1 marks in parallel.
+    // Writes a JSON line per script as it finishes, returns the number of failed ones
+    int run_batch(const std::vector<std::string> &files, unsigned jobs, long gc_pause_us, unsigned gc_threads,
+                  std::ostream &out) {
+        std::atomic<size_t> next = 0;
+        std::atomic<int> failed = 0;
+        std::mutex out_mutex;
+        std::vector<std::thread> workers;
+        for (unsigned w = 0; w < jobs; ++w) {
+            workers.emplace_back([&] {
+                auto vm = std::make_unique<interpreter::VMData>();
+                if (gc_pause_us >= 0) {
+                    vm->gc.incremental = true;
+                    vm->gc.pause_budget = std::chrono::microseconds(gc_pause_us);
+                }
+                vm->gc.mark_threads = gc_threads;
+                for (size_t i; (i = next++) < files.size();) {
+                    const JobResult res = run_script(*vm, files[i]);
+                    if (!res.ok) failed++;
+                    const std::string line = to_json(files[i], res);
+                    std::lock_guard lock(out_mutex);
+                    out << line << std::endl;
+                }
+            });
+        }
+        for (auto &worker: workers) worker.join();
+        return failed;
+    }
+
+    void usage() {
+        std::cerr << "usage: cote <script.ct>\n"
+                     "       cote --batch <directory|manifest> [-j <workers>] [-o <results.jsonl>] [--gc-pause <us>]\n"
+                     "            [--gc-threads <markers>]\n"
+                     "Without -o the results go to stdout and the output of the scripts to stderr.\n";
+    }
+}
 
-int main() {
-    std::cout << sizeof(interpreter::Value);
-    return 0;
+int main(int argc, char **argv) {
+    if (argc == 2 && std::strcmp(argv[1], "--batch") != 0) {
+        auto vm = std::make_unique<interpreter::VMData>();
+        const JobResult res = run_script(*vm, argv[1]);
+        if (!res.ok) {
+            std::cerr << argv[1] << ": " << res.error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc < 3 || std::strcmp(argv[1], "--batch") != 0) {
+        usage();
+        return 2;
+    }
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string out_path;
+    long gc_pause_us = -1;
+    unsigned gc_threads = 1;
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else if (std::strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            out_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--gc-pause") == 0 && i + 1 < argc) {
+            gc_pause_us = std::max(0L, std::atol(argv[++i]));
+        } else if (std::strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+            gc_threads = std::max(1, std::atoi(argv[++i]));
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    try {
+        const auto files = collect_scripts(argv[2]);
+        if (out_path.empty()) {
+            // the results keep stdout to themselves, what the scripts print goes to stderr
+            std::ostream out(std::cout.rdbuf());
+            std::cout.rdbuf(std::cerr.rdbuf());
+            const int failed = run_batch(files, jobs, gc_pause_us, gc_threads, out);
+            std::cout.rdbuf(out.rdbuf());
+            return failed == 0 ? 0 : 1;
+        }
+        std::ofstream out(out_path);
+        if (!out) throw std::runtime_error("cannot open " + out_path);
+        return run_batch(files, jobs, gc_pause_us, gc_threads, out) == 0 ? 0 : 1;
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
 }
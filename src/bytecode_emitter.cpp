@@ -3,43 +3,75 @@
 //
 #include <format>
 #include "bytecode_emitter.h"
-#include <cstring>
+#include "stack_map.h"
+#include <bit>
 
 void interpreter::BytecodeEmitter::emit_add(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_ADD, a, b, c));
+    add_abc(OpCode::OP_ADD, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_sub(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_SUB, a, b, c));
+    add_abc(OpCode::OP_SUB, a, b, c);
+    use_regs(a, b, c);
 
 }
 
 void interpreter::BytecodeEmitter::emit_mul(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_MUL, a, b, c));
+    add_abc(OpCode::OP_MUL, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_div(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_DIV, a, b, c));
+    add_abc(OpCode::OP_DIV, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_mod(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_MOD, a, b, c));
+    add_abc(OpCode::OP_MOD, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_move(int a, int b) {
     using namespace interpreter;
     if (a == b) return;
-    add(opcode(OpCode::OP_MOVE, a, b, 0));
+    add_abc(OpCode::OP_MOVE, a, b, 0);
+    use_regs(a, b);
+}
+
+void interpreter::BytecodeEmitter::emit_arith_imm(OpCode op, int a, int b, int imm) {
+    using namespace interpreter;
+    add_abc(op, a, b, imm + (int32_t) IMM_ZERO);
+    use_regs(a, b);
+}
+
+void interpreter::BytecodeEmitter::emit_arith_k(OpCode op, int a, int b, int k) {
+    using namespace interpreter;
+    add_abc(op, a, b, k);
+    use_regs(a, b);
+}
+
+int interpreter::BytecodeEmitter::kconstant(Value val) {
+    auto &it = kconstants[val.as_uint64()];
+    if (it == 0) {
+        if (kconstant_count > (int) C_ARG) {
+            kconstants.erase(val.as_uint64());
+            return -1;
+        }
+        it = ++kconstant_count;
+    }
+    return it - 1;
 }
 
 void interpreter::BytecodeEmitter::emit_neg(int a, int b) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_NEG, a, b, 0));
+    add_abc(OpCode::OP_NEG, a, b, 0);
+    use_regs(a, b);
 }
 
 // Value creation helpers
@@ -55,48 +87,56 @@ namespace {
 void interpreter::BytecodeEmitter::emit_loadi(int a, int imm) {
     auto &it = iconstants[imm];
     if (it == 0) it = ++iconstant_count;
-    add(opcode(OpCode::OP_LOADINT, a, it - 1));
+    add_abx(OpCode::OP_LOADINT, a, it - 1);
+    use_regs(a);
 }
 
 void interpreter::BytecodeEmitter::emit_loadnil(int a) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_LOADNIL, a, 0, 0));
+    add_abc(OpCode::OP_LOADNIL, a, 0, 0);
+    use_regs(a);
 }
 
 void interpreter::BytecodeEmitter::emit_eq(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_EQ, a, b, c));
+    add_abc(OpCode::OP_EQ, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_less(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_LT, a, b, c));
+    add_abc(OpCode::OP_LT, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_leq(int a, int b, int c) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_LE, a, b, c));
+    add_abc(OpCode::OP_LE, a, b, c);
+    use_regs(a, b, c);
 }
 
 
 void interpreter::BytecodeEmitter::emit_jtrue(int a, int offset) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_JMPT, a, offset));
+    add_abx(OpCode::OP_JMPT, a, offset + (int32_t) J_ZERO);
+    use_regs(a);
 }
 
 void interpreter::BytecodeEmitter::emit_jmp(int offset) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_JMP, 0, offset));
+    add(jmp(offset));
 }
 
 void interpreter::BytecodeEmitter::emit_jfalse(int a, int offset) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_JMPF, a, offset));
+    add_abx(OpCode::OP_JMPF, a, offset + (int32_t) J_ZERO);
+    use_regs(a);
 }
 
 void interpreter::BytecodeEmitter::emit_return(int res) {
     using namespace interpreter;
-    add(opcode(OpCode::OP_RETURN, res, 0, 0));
+    add_abc(OpCode::OP_RETURN, res, 0, 0);
+    use_regs(res);
 }
 
 //in the end of each function resolve labels;
@@ -111,9 +151,14 @@ void interpreter::BytecodeEmitter::emit_return(int res) {
 // - and in begin_func and in the absolute end resolve.
 int interpreter::BytecodeEmitter::begin_func(int args, std::string name) {
     resolve();
+    if (cur_func > static_cast<int>(BX_ARG))
+        throw std::runtime_error("too many functions");
+    if (cur_func == static_cast<int>(funcs.size()))
+        funcs.emplace_back();
     funcs[cur_func].name = std::move(name);
     funcs[cur_func].arity = args;
     funcs[cur_func].code.clear();
+    funcs[cur_func].max_reg = -1;
     is_in_func = true;
     return cur_func;
 }
@@ -136,16 +181,49 @@ void interpreter::BytecodeEmitter::label(int32_t pos) {
 
 void interpreter::BytecodeEmitter::resolve() {
     using namespace interpreter;
+    auto &code = get();
+    // OP_JMPT/OP_JMPF whose offset does not fit into bx get an OP_EXTRAARG prefix. Inserting it moves
+    // the code after it, which may push other jumps out of range, so repeat until nothing changes
+    for (bool relaxed = true; relaxed;) {
+        relaxed = false;
+        for (auto &cur: pending_labels) {
+            const auto op = static_cast<OpCode>(code[cur.first] >> OPCODE_SHIFT);
+            if (op == OP_JMP || has_prefix(cur.first)) continue;
+            auto it = label_pos.find(cur.second);
+            if (it == label_pos.end()) throw std::runtime_error("ill formed bytecode");
+            const int64_t bx = (int64_t) it->second - cur.first - 1 + J_ZERO;
+            if (bx >= 0 && bx <= BX_ARG) continue;
+            const int pos = cur.first;
+            code.insert(code.begin() + pos, extraarg(0));
+            // a label at pos now points to the prefix, so only the ones after it move
+            for (auto &other: pending_labels) {
+                if (other.first >= pos) other.first++;
+            }
+            for (auto &label: label_pos) {
+                if (label.second > pos) label.second++;
+            }
+            relaxed = true;
+        }
+    }
     for (auto &cur: pending_labels) {
         auto it = label_pos.find(cur.second);
         if (it == label_pos.end()) throw std::runtime_error("ill formed bytecode");
-        auto &instr = get()[cur.first];
+        auto &instr = code[cur.first];
         const auto op = static_cast<OpCode>(instr >> OPCODE_SHIFT);
-        uint8_t a = (instr >> A_SHIFT) & A_ARG;
-        const int bx = (it->second - cur.first - 1);
-        //TODO: SBX_MAX, ?LONG INSTRUCTIONS?
-        if (abs(bx) > 10000) throw std::runtime_error("TODO: sbx is too large(code is too large), cannot emit jump");
-        instr = opcode(op, a, bx + (int32_t) J_ZERO);
+        const int offset = it->second - cur.first - 1;
+        if (op == OP_JMP) {
+            if (offset < -(int32_t) SJ_ZERO || offset > (int32_t) SJ_ZERO + 1)
+                throw std::runtime_error("jump is too far, cannot emit jump");
+            instr = jmp(offset);
+            continue;
+        }
+        const uint32_t a = (instr >> A_SHIFT) & A_ARG;
+        const uint32_t bx = static_cast<uint32_t>(offset + (int32_t) J_ZERO);
+        instr = opcode(op, a, bx & BX_ARG);
+        if (has_prefix(cur.first)) {
+            auto &prefix = code[cur.first - 1];
+            prefix = extraarg((prefix & A_ARG) | (bx >> 18) << 8);
+        }
     }
     pending_labels.clear();
     label_pos.clear();
@@ -153,20 +231,36 @@ void interpreter::BytecodeEmitter::resolve() {
 
 void interpreter::BytecodeEmitter::jmp_label(int label) {
     using namespace interpreter;
-    pending_labels.emplace_back(get().size(), label);
-    add(opcode(OpCode::OP_JMP, 0, label));
+    add(jmp(0));
+    pending_labels.emplace_back(get().size() - 1, label);
 }
 
 void interpreter::BytecodeEmitter::jmpt_label(int a, int label) {
     using namespace interpreter;
-    pending_labels.emplace_back(get().size(), label);
-    add(opcode(OpCode::OP_JMPT, a, 0));
+    add_abx(OpCode::OP_JMPT, a, 0);
+    use_regs(a);
+    pending_labels.emplace_back(get().size() - 1, label);
 }
 
 void interpreter::BytecodeEmitter::jmpf_label(int a, int label) {
     using namespace interpreter;
-    pending_labels.emplace_back(get().size(), label);
-    add(opcode(OpCode::OP_JMPF, a, 0));
+    add_abx(OpCode::OP_JMPF, a, 0);
+    use_regs(a);
+    pending_labels.emplace_back(get().size() - 1, label);
+}
+
+void interpreter::BytecodeEmitter::cmp_jmp_label(OpCode op, int b, int c, int label) {
+    using namespace interpreter;
+    add_abc(op, 0, b, c);
+    use_regs(b, c);
+    jmp_label(label);
+}
+
+void interpreter::BytecodeEmitter::cmp_imm_jmp_label(OpCode op, int b, int imm, bool negate, int label) {
+    using namespace interpreter;
+    add_abc(op, negate, b, imm + (int32_t) IMM_ZERO);
+    use_regs(b);
+    jmp_label(label);
 }
 
 
@@ -178,6 +272,7 @@ void interpreter::BytecodeEmitter::initVM(interpreter::VMData &vm) {
             cur = i;
     }
     if (cur == -1) throw std::runtime_error("no main method found");
+    // a main past A_ARG gets its index widened by an OP_EXTRAARG prefix
     emit_call_direct(cur, 0, 0);
     emit_halt();
     vm.constanti.resize(iconstant_count);
@@ -188,19 +283,48 @@ void interpreter::BytecodeEmitter::initVM(interpreter::VMData &vm) {
     for (auto &it: fconstants) {
         vm.constantf[it.second - 1].set_float(it.first);
     }
-    size_t offset = 0;
-    vm.functions_count = cur_func;
+    vm.constantk.resize(kconstant_count);
+    for (auto &it: kconstants) {
+        vm.constantk[it.second - 1] = std::bit_cast<Value>(it.first);
+    }
+    vm.functions.assign(cur_func, Function{});
+    vm.code.clear();
     for (int i = 0; i < cur_func; ++i) {
         vm.functions[i].arity = funcs[i].arity;
-        vm.functions[i].entry_point = offset;
+        vm.functions[i].entry_point = vm.code.size();
         vm.functions[i].code_size = funcs[i].code.size();
-        std::memcpy(vm.code + offset, funcs[i].code.data(), funcs[i].code.size() * sizeof(uint32_t));
-        offset += funcs[i].code.size();
+        // a return writes register 0 even if the code names none
+        vm.functions[i].max_stack = std::max({1, funcs[i].arity, funcs[i].max_reg + 1});
+        vm.code.insert(vm.code.end(), funcs[i].code.begin(), funcs[i].code.end());
     }
-    vm.ip = offset;
+    for (auto &func: vm.functions) {
+        build_stack_map(vm.code, func);
+    }
+    vm.ip = vm.code.size();
     vm.sp = vm.fp = 0;
-    std::memcpy(vm.code + offset, global.data(), global.size() * sizeof(uint32_t));
-    vm.code_size = global.size() + offset;
+    vm.code.insert(vm.code.end(), global.begin(), global.end());
+}
+
+void interpreter::BytecodeEmitter::add_abc(OpCode op, uint32_t a, uint32_t b, uint32_t c) {
+    if (a > A_ARG || b > B_ARG || c > C_ARG) {
+        if (a >> 8 > A_ARG || b >> 9 > B_ARG || c >> 9 > C_ARG)
+            throw std::runtime_error("operand is too large, cannot emit instruction");
+        add(extraarg(a >> 8 | (b >> 9) << 8 | (c >> 9) << 17));
+    }
+    add(opcode(op, a & A_ARG, b & B_ARG, c & C_ARG));
+}
+
+void interpreter::BytecodeEmitter::add_abx(OpCode op, uint32_t a, uint32_t bx) {
+    if (a > A_ARG || bx > BX_ARG) {
+        if (a >> 8 > A_ARG)
+            throw std::runtime_error("operand is too large, cannot emit instruction");
+        add(extraarg(a >> 8 | (bx >> 18) << 8));
+    }
+    add(opcode(op, a & A_ARG, bx & BX_ARG));
+}
+
+bool interpreter::BytecodeEmitter::has_prefix(int pos) {
+    return pos > 0 && get()[pos - 1] >> OPCODE_SHIFT == OP_EXTRAARG;
 }
 
 void interpreter::BytecodeEmitter::emit_halt() {
@@ -212,42 +336,56 @@ void interpreter::BytecodeEmitter::emit_retnil() {
 }
 
 void interpreter::BytecodeEmitter::emit_call(int funcid, int reg, int count) {
-    add(opcode(OpCode::OP_INVOKEDYNAMIC, funcid, reg, count));
+    add_abc(OpCode::OP_INVOKEDYNAMIC, funcid, reg, count);
+    use_regs(funcid, reg, reg + count - 1);
+}
+
+void interpreter::BytecodeEmitter::emit_tailcall(int funcid, int reg, int count) {
+    add_abc(OpCode::OP_TAILCALL, funcid, reg, count);
+    use_regs(funcid, reg, reg + count - 1);
 }
 
 void interpreter::BytecodeEmitter::emit_loadfunc(uint32_t reg, uint32_t fid) {
-    add(opcode(OpCode::OP_LOADFUNC, reg, fid));
+    add_abx(OpCode::OP_LOADFUNC, reg, fid);
+    use_regs(reg);
 }
 
 void interpreter::BytecodeEmitter::emit_arrayget(int to, int from, int offset) {
-    add(opcode(OpCode::OP_ARRGET, to, from, offset));
+    add_abc(OpCode::OP_ARRGET, to, from, offset);
+    use_regs(to, from, offset);
 }
 
 void interpreter::BytecodeEmitter::emit_arrayset(int to, int offset, int from) {
-    add(opcode(OpCode::OP_ARRSET, to, offset, from));
+    add_abc(OpCode::OP_ARRSET, to, offset, from);
+    use_regs(to, offset, from);
 }
 
 
 void interpreter::BytecodeEmitter::emit_native(int id, int from, int cnt) {
-    add(opcode(OpCode::OP_NATIVE_CALL, id, from, cnt));
+    add_abc(OpCode::OP_NATIVE_CALL, id, from, cnt);
+    use_regs(from, from + cnt - 1);
 }
 
 void interpreter::BytecodeEmitter::emit_call_direct(int funcid, int reg, int count) {
-    add(opcode(OpCode::OP_CALL, funcid, reg, count));
+    add_abc(OpCode::OP_CALL, funcid, reg, count);
+    use_regs(reg, reg + count - 1);
 }
 
 void interpreter::BytecodeEmitter::emit_alloc(uint32_t reg, uint32_t reg2) {
-    add(opcode(OpCode::OP_ALLOC, reg, reg2, 0));
+    add_abc(OpCode::OP_ALLOC, reg, reg2, 0);
+    use_regs(reg, reg2);
 }
 
 void interpreter::BytecodeEmitter::emit_neq(int a, int b, int c) {
-    add(opcode(OpCode::OP_NEQ, a, b, c));
+    add_abc(OpCode::OP_NEQ, a, b, c);
+    use_regs(a, b, c);
 }
 
 void interpreter::BytecodeEmitter::emit_loadf(uint32_t reg, float imm) {
     auto &it = fconstants[imm];
     if (it == 0) it = ++fconstant_count;
-    add(opcode(OpCode::OP_LOADFLOAT, reg, it - 1));
+    add_abx(OpCode::OP_LOADFLOAT, reg, it - 1);
+    use_regs(reg);
 }
 
 
@@ -7,6 +7,7 @@
 
 #include "misc.h"
 #include "vm.h"
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
 
@@ -15,6 +16,8 @@ namespace interpreter {
         std::string name;
         std::vector<uint32_t> code;
         int arity = 0;
+        // highest register the code uses, it sizes Function::max_stack
+        int max_reg = -1;
     };
 
     struct BytecodeEmitter {
@@ -23,11 +26,13 @@ namespace interpreter {
         std::vector<uint32_t> global;
         std::unordered_map<int, int> iconstants;
         std::unordered_map<float, int> fconstants;
+        std::unordered_map<uint64_t, int> kconstants;
         int iconstant_count = 0;
         int fconstant_count = 0;
+        int kconstant_count = 0;
         int cur_func = 0;
         bool is_in_func = false;
-        EmitFunc funcs[1024];
+        std::vector<EmitFunc> funcs;
 
         //TODO: use unordered_map
 
@@ -62,6 +67,9 @@ namespace interpreter {
 
         void emit_call_direct(int funcid, int reg, int count);
 
+        // Same operands as emit_call, for a call whose result is returned right away
+        void emit_tailcall(int funcid, int reg, int count);
+
         // Adds two values
         // Args: a - destination, b - first operand, c - second operand
         // Behavior: registers[a] = registers[b] + registers[c] (int/float)
@@ -88,6 +96,20 @@ namespace interpreter {
         // Behavior: registers[a] = registers[b] % registers[c]
         void emit_mod(int a, int b, int c);
 
+        // Arithmetic with an immediate operand
+        // Args: op - OP_ADDI, OP_SUBI or OP_MULI, a - destination, b - source register,
+        //       imm - int in [IMM_MIN, IMM_MAX]
+        // Behavior: registers[a] = registers[b] <op> imm
+        void emit_arith_imm(OpCode op, int a, int b, int imm);
+
+        // Arithmetic with a constant operand
+        // Args: op - one of OP_ADDK..OP_MODK, a - destination, b - source register, k - index from kconstant()
+        // Behavior: registers[a] = registers[b] <op> constantk[k]
+        void emit_arith_k(OpCode op, int a, int b, int k);
+
+        // Index of val in the pool of constant operands, -1 if the pool is full
+        int kconstant(Value val);
+
         // Copies value between registers
         // Args: a - destination register, b - source register
         // Behavior: registers[a] = registers[b]
@@ -136,6 +158,17 @@ namespace interpreter {
 
         void jmpf_label(int a, int label);
 
+        // Fused compare-and-branch
+        // Args: op - one of OP_JEQ..OP_JNLE, b, c - compared registers
+        // Behavior: emits op followed by the OP_JMP to label, taken when the comparison holds
+        void cmp_jmp_label(OpCode op, int b, int c, int label);
+
+        // Fused compare-with-immediate and branch
+        // Args: op - one of OP_EQI..OP_GEI, b - compared register, imm - int in [IMM_MIN, IMM_MAX]
+        // Behavior: emits op followed by the OP_JMP to label, taken when the comparison holds
+        //           (or when it fails if negate is set)
+        void cmp_imm_jmp_label(OpCode op, int b, int imm, bool negate, int label);
+
         // Jump if true
         // Args: a - condition register, sbx - signed offset
         // Behavior: if (registers[a]) ip += offset
@@ -203,6 +236,21 @@ namespace interpreter {
 
     private:
 
+        // Emit the instruction, with an OP_EXTRAARG prefix if an operand does not fit into its field
+        void add_abc(OpCode op, uint32_t a, uint32_t b, uint32_t c);
+
+        void add_abx(OpCode op, uint32_t a, uint32_t bx);
+
+        // Whether the instruction at pos of the current code is widened by an OP_EXTRAARG
+        bool has_prefix(int pos);
+
+        template<class... Regs>
+        inline void use_regs(Regs... regs) {
+            if (is_in_func) {
+                funcs[cur_func].max_reg = std::max({funcs[cur_func].max_reg, static_cast<int>(regs)...});
+            }
+        }
+
         inline void add(uint32_t instr) {
             if (is_in_func) {
                 funcs[cur_func].code.push_back(instr);
@@ -8,8 +8,8 @@
 #include <stdexcept>
 
 namespace parser {
-    bool panic_mode = false;
-    std::vector<std::string> error_log;
+    thread_local bool panic_mode = false;
+    thread_local std::vector<std::string> error_log;
 
     void init_exceptions() {
         error_log.clear();
@@ -33,8 +33,127 @@ namespace {
         } else throw std::runtime_error("todo");
     }
 
+    // Register of a local variable read directly, otherwise node is evaluated into a new temp.
+    // temps is incremented for every pushed temp.
+    int operand_reg(ast::Node *node, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars, int &temps) {
+        if (node->get_type() == ast::NodeType::Var) {
+            const int res = vars.get_var(dynamic_cast<ast::VarExpr *>(node)->name);
+            if (res != -1) return res;
+        }
+        eval_expr(node, emitter, vars);
+        temps++;
+        return vars.last();
+    }
+
+    // int literal that fits into an immediate operand
+    bool imm_literal(ast::Node *node, int &imm) {
+        if (node->get_type() != ast::NodeType::IntLit) return false;
+        const int64_t val = dynamic_cast<ast::IntLitExpr *>(node)->number;
+        if (val < interpreter::IMM_MIN || val > interpreter::IMM_MAX) return false;
+        imm = static_cast<int>(val);
+        return true;
+    }
+
+    // Picks the immediate (OP_ADDI..) or constant operand (OP_ADDK..) form of `x <type> lit`
+    bool literal_form(ast::BinaryOpType type, ast::Node *lit, interpreter::BytecodeEmitter &emitter,
+                      interpreter::OpCode &op, int &operand) {
+        using namespace interpreter;
+        using ast::BinaryOpType;
+        if (imm_literal(lit, operand)) {
+            if (type == BinaryOpType::ADD) return op = OP_ADDI, true;
+            if (type == BinaryOpType::SUB) return op = OP_SUBI, true;
+            if (type == BinaryOpType::MUL) return op = OP_MULI, true;
+        }
+        Value val;
+        if (lit->get_type() == ast::NodeType::IntLit) val.set_int(dynamic_cast<ast::IntLitExpr *>(lit)->number);
+        else if (lit->get_type() == ast::NodeType::FloatLit) val.set_float(dynamic_cast<ast::FloatLitExpr *>(lit)->number);
+        else return false;
+        switch (type) {
+            case BinaryOpType::ADD:
+                op = OP_ADDK;
+                break;
+            case BinaryOpType::SUB:
+                op = OP_SUBK;
+                break;
+            case BinaryOpType::MUL:
+                op = OP_MULK;
+                break;
+            case BinaryOpType::DIV:
+                op = OP_DIVK;
+                break;
+            case BinaryOpType::MOD:
+                op = OP_MODK;
+                break;
+            default:
+                return false;
+        }
+        operand = emitter.kconstant(val);
+        return operand != -1;
+    }
+
+    void emit_literal_form(interpreter::BytecodeEmitter &emitter, interpreter::OpCode op, int a, int b, int operand) {
+        using namespace interpreter;
+        if (op == OP_ADDI || op == OP_SUBI || op == OP_MULI) emitter.emit_arith_imm(op, a, b, operand);
+        else emitter.emit_arith_k(op, a, b, operand);
+    }
+
+    // `x op lit` (or `lit op x` for commutative ops) with the literal folded into the instruction
+    template<typename T>
+    bool eval_literal_binary(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars) {
+        constexpr auto mtype = T::ownType();
+        ast::Node *x = dynamic_cast<T *>(expr)->l.get();
+        ast::Node *lit = dynamic_cast<T *>(expr)->r.get();
+        interpreter::OpCode op;
+        int operand;
+        if (!literal_form(mtype, lit, emitter, op, operand)) {
+            if constexpr (mtype != ast::BinaryOpType::ADD && mtype != ast::BinaryOpType::MUL) return false;
+            std::swap(x, lit);
+            if (!literal_form(mtype, lit, emitter, op, operand)) return false;
+        }
+        int temps = 0;
+        const int src = operand_reg(x, emitter, vars, temps);
+        emit_literal_form(emitter, op, temps ? src : vars.push_var(), src, operand);
+        return true;
+    }
+
+    // comparison with an int literal on either side as a fused compare-with-immediate and branch
+    template<typename T>
+    bool fused_imm_cond_jump(ast::Node *expr, interpreter::OpCode op, interpreter::OpCode mirrored, bool negate,
+                             int label, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars) {
+        auto cur = dynamic_cast<T *>(expr);
+        ast::Node *x;
+        int imm;
+        if (imm_literal(cur->r.get(), imm)) {
+            x = cur->l.get();
+        } else if (imm_literal(cur->l.get(), imm)) {
+            x = cur->r.get();
+            op = mirrored;
+        } else return false;
+        int temps = 0;
+        emitter.cmp_imm_jmp_label(op, operand_reg(x, emitter, vars, temps), imm, negate, label);
+        vars.drop(temps);
+        return true;
+    }
+
+    template<typename T>
+    void fused_cond_jump(ast::Node *expr, interpreter::OpCode op, bool swap, int label,
+                         interpreter::BytecodeEmitter &emitter, parser::VarManager &vars) {
+        int temps = 0;
+        const int l = operand_reg(dynamic_cast<T *>(expr)->l.get(), emitter, vars, temps);
+        const int r = operand_reg(dynamic_cast<T *>(expr)->r.get(), emitter, vars, temps);
+        vars.drop(temps);
+        if (swap) emitter.cmp_jmp_label(op, r, l, label);
+        else emitter.cmp_jmp_label(op, l, r, label);
+    }
+
     template<typename T>
     void simple_eval_binary(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars) {
+        constexpr auto mtype = T::ownType();
+        if constexpr (mtype == ast::BinaryOpType::ADD || mtype == ast::BinaryOpType::SUB ||
+                      mtype == ast::BinaryOpType::MUL || mtype == ast::BinaryOpType::DIV ||
+                      mtype == ast::BinaryOpType::MOD) {
+            if (eval_literal_binary<T>(expr, emitter, vars)) return;
+        }
         eval_expr(dynamic_cast<T *>(expr)->l.get(), emitter, vars);
         eval_expr(dynamic_cast<T *>(expr)->r.get(), emitter, vars);
         get_func<T::ownType()>(emitter, vars);//vars.last() - 1, vars.last() - 1, vars.last());
@@ -174,6 +293,77 @@ parser::eval_expr(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser
     return true;
 }
 
+bool parser::eval_cond_jump(ast::Node *expr, bool jump_if, int label, interpreter::BytecodeEmitter &emitter,
+                            parser::VarManager &vars) {
+    using namespace ast;
+    using namespace interpreter;
+    if (expr == nullptr) return false;
+    switch (expr->get_type()) {
+        case NodeType::BinaryLS:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::LS>>(expr, OP_LTI, OP_GTI, !jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::LS>>(expr, jump_if ? OP_JLT : OP_JNLT, false, label, emitter, vars);
+            break;
+        case NodeType::BinaryLE:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::LE>>(expr, OP_LEI, OP_GEI, !jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::LE>>(expr, jump_if ? OP_JLE : OP_JNLE, false, label, emitter, vars);
+            break;
+        case NodeType::BinaryGR:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::GR>>(expr, OP_GTI, OP_LTI, !jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::GR>>(expr, jump_if ? OP_JLT : OP_JNLT, true, label, emitter, vars);
+            break;
+        case NodeType::BinaryGE:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::GE>>(expr, OP_GEI, OP_LEI, !jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::GE>>(expr, jump_if ? OP_JLE : OP_JNLE, true, label, emitter, vars);
+            break;
+        case NodeType::BinaryEQ:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::EQ>>(expr, OP_EQI, OP_EQI, !jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::EQ>>(expr, jump_if ? OP_JEQ : OP_JNE, false, label, emitter, vars);
+            break;
+        case NodeType::BinaryNEQ:
+            if (!fused_imm_cond_jump<BinaryExpr<BinaryOpType::NEQ>>(expr, OP_EQI, OP_EQI, jump_if, label, emitter, vars))
+                fused_cond_jump<BinaryExpr<BinaryOpType::NEQ>>(expr, jump_if ? OP_JNE : OP_JEQ, false, label, emitter, vars);
+            break;
+        default:
+            if (!eval_expr(expr, emitter, vars)) return false;
+            if (jump_if) emitter.jmpt_label(vars.pop_var(), label);
+            else emitter.jmpf_label(vars.pop_var(), label);
+    }
+    return true;
+}
+
+bool parser::emit_literal_operand(ast::BinaryOpType type, int dst, int src, ast::Node *lit,
+                                  interpreter::BytecodeEmitter &emitter) {
+    interpreter::OpCode op;
+    int operand;
+    if (!literal_form(type, lit, emitter, op, operand)) return false;
+    emit_literal_form(emitter, op, dst, src, operand);
+    return true;
+}
+
+bool parser::eval_tail_call(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars) {
+    using namespace ast;
+    if (expr->get_type() != NodeType::FunctionCall) return false;
+    auto call = dynamic_cast<FunctionCall *>(expr);
+    auto name = call->name_expr.get();
+    if (name->get_type() == NodeType::Var) {
+        std::string &sname = dynamic_cast<VarExpr *>(name)->name;
+        if (sname == "array" || vars.get_native(sname) != -1) return false;
+    }
+    if (!check_lvalue(expr, emitter, vars)) parser_throws(error_msg("lvalue failed"));
+    eval_expr(name, emitter, vars);
+    const int start = vars.last();
+    int cnt = 0;
+    for (auto &cur: call->args) {
+        cnt++;
+        if (!eval_expr(cur.get(), emitter, vars)) {
+            return false;
+        }
+    }
+    emitter.emit_tailcall(start, start + 1, cnt);
+    vars.drop(cnt + 1);
+    return true;
+}
+
 bool parser::check_lvalue(ast::Node *node, interpreter::BytecodeEmitter &emitter,
                           parser::VarManager &vars) {
     const auto mtype = node->get_type();
@@ -12,6 +12,20 @@
 namespace parser {
     bool eval_expr(ast::Node* expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars);
 
+    // Emits a jump to label taken when expr is truthy (jump_if) or falsy (!jump_if).
+    // Comparisons become a single fused compare-and-branch instead of a temp + OP_JMPT/OP_JMPF.
+    bool eval_cond_jump(ast::Node *expr, bool jump_if, int label, interpreter::BytecodeEmitter &emitter,
+                        parser::VarManager &vars);
+
+    // Emits registers[dst] = registers[src] <type> lit with the literal folded into the instruction
+    // (OP_ADDI.., OP_ADDK..). Emits nothing and returns false if lit is not a suitable literal.
+    bool emit_literal_operand(ast::BinaryOpType type, int dst, int src, ast::Node *lit,
+                              interpreter::BytecodeEmitter &emitter);
+
+    // Emits `return expr` as OP_TAILCALL if expr is a call of a cote function (not a native or array()).
+    // Emits nothing and returns false otherwise.
+    bool eval_tail_call(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars);
+
     bool check_lvalue(ast::Node *expr, interpreter::BytecodeEmitter &emitter, parser::VarManager &vars);
 }
 
@@ -6,4 +6,52 @@
 
 namespace heap {
     // std::byte GarbageCollector::young_buffer[GarbageCollector::YOUNG_THRESHOLD * sizeof(interpreter::Value)];
+
+    MarkerPool::MarkerPool(unsigned markers) : deques_(std::max(markers, 1u)) {
+        for (unsigned id = 1; id < deques_.size(); ++id) {
+            threads_.emplace_back(&MarkerPool::helper, this, id);
+        }
+    }
+
+    MarkerPool::~MarkerPool() {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto &thread: threads_) {
+            thread.join();
+        }
+    }
+
+    void MarkerPool::run(const std::function<void(unsigned)> &job) {
+        {
+            std::lock_guard lock(mutex_);
+            job_ = &job;
+            running_ = static_cast<unsigned>(threads_.size());
+            generation_++;
+        }
+        wake_.notify_all();
+        job(0);
+        std::unique_lock lock(mutex_);
+        done_.wait(lock, [this] { return running_ == 0; });
+        job_ = nullptr;
+    }
+
+    void MarkerPool::helper(unsigned id) {
+        uint64_t seen = 0;
+        while (true) {
+            const std::function<void(unsigned)> *job;
+            {
+                std::unique_lock lock(mutex_);
+                wake_.wait(lock, [this, seen] { return stop_ || generation_ != seen; });
+                if (stop_) return;
+                seen = generation_;
+                job = job_;
+            }
+            (*job)(id);
+            std::lock_guard lock(mutex_);
+            if (--running_ == 0) done_.notify_one();
+        }
+    }
 } // heap
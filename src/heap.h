@@ -5,61 +5,168 @@
 #ifndef HEAP_H
 #define HEAP_H
 
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
-#include <memory_resource>
 #include <cstddef>
 #include <iostream>
-#include <map>
-#include <stack>
-#include <unordered_set>
-#include <ranges>
 #include <algorithm>
+#include <cstring>
+#include <numeric>
 
+#include "heap_cage.h"
 #include "value.h"
 
 #define ALL(a) a.begin(), a.end()
 
+#if defined(__GNUC__) || defined(__clang__)
+#define COTE_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define COTE_PREFETCH(p) ((void) (p))
+#endif
+
 namespace heap {
-    inline std::map<uint32_t, interpreter::Value *> mem{};
+    // Number of collections of each kind since the last cleanup()
+    struct GcStats {
+        uint64_t minor = 0;
+        uint64_t major = 0;
+        uint64_t large = 0;
+        uint64_t compactions = 0;
+        // bounded steps of incremental cycles, the finishing one included, and the longest of them
+        uint64_t mark_steps = 0;
+        uint64_t max_step_us = 0;
+        // HeapCage::fragmentation() around the last compaction
+        double fragmentation_before = 0;
+        double fragmentation_after = 0;
+    };
+
+    // Grey objects one parallel marker shares, a bounded Chase-Lev deque: its owner pushes and pops at the
+    // bottom without locking, idle markers steal from the top by a CAS on it
+    class StealDeque {
+    public:
+        static constexpr int64_t CAPACITY = int64_t{1} << 12;
+
+        StealDeque() : buffer_(new std::atomic<interpreter::Value *>[CAPACITY]) {
+        }
+
+        // owner only, false if the deque is full
+        bool push(interpreter::Value *item) {
+            const int64_t b = bottom_.load(std::memory_order_relaxed);
+            const int64_t t = top_.load(std::memory_order_acquire);
+            if (b - t >= CAPACITY) return false;
+            buffer_[b & (CAPACITY - 1)].store(item, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            bottom_.store(b + 1, std::memory_order_relaxed);
+            return true;
+        }
+
+        // owner only, the item pushed last or nullptr
+        interpreter::Value *pop() {
+            const int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+            bottom_.store(b, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t t = top_.load(std::memory_order_relaxed);
+            if (t > b) {
+                bottom_.store(b + 1, std::memory_order_relaxed);
+                return nullptr;
+            }
+            interpreter::Value *item = buffer_[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (t == b) {
+                // the last item, a thief may take it first
+                if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                    item = nullptr;
+                }
+                bottom_.store(b + 1, std::memory_order_relaxed);
+            }
+            return item;
+        }
+
+        // any thread, the oldest item or nullptr, also when another thread took it first
+        interpreter::Value *steal() {
+            int64_t t = top_.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const int64_t b = bottom_.load(std::memory_order_acquire);
+            if (t >= b) return nullptr;
+            interpreter::Value *item = buffer_[t & (CAPACITY - 1)].load(std::memory_order_relaxed);
+            if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+                return nullptr;
+            }
+            return item;
+        }
+
+        [[nodiscard]] bool empty() const {
+            return bottom_.load(std::memory_order_acquire) <= top_.load(std::memory_order_acquire);
+        }
+
+    private:
+        alignas(64) std::atomic<int64_t> top_ = 0;
+        alignas(64) std::atomic<int64_t> bottom_ = 0;
+        std::unique_ptr<std::atomic<interpreter::Value *>[]> buffer_;
+    };
+
+    // The markers of parallel marking: helper threads parked between collections and a StealDeque per marker,
+    // the collecting thread is marker 0
+    class MarkerPool {
+    public:
+        explicit MarkerPool(unsigned markers);
+
+        ~MarkerPool();
+
+        MarkerPool(const MarkerPool &) = delete;
+
+        MarkerPool &operator=(const MarkerPool &) = delete;
+
+        // runs job(id) for every marker, on the calling thread for id 0, and returns once all of them are done
+        void run(const std::function<void(unsigned)> &job);
+
+        [[nodiscard]] unsigned size() const { return static_cast<unsigned>(deques_.size()); }
+
+        StealDeque &deque(unsigned id) { return deques_[id]; }
+
+        [[nodiscard]] const std::vector<StealDeque> &deques() const { return deques_; }
+
+    private:
+        void helper(unsigned id);
+
+        std::vector<StealDeque> deques_;
+        std::vector<std::thread> threads_;
+        std::mutex mutex_;
+        std::condition_variable wake_;
+        std::condition_variable done_;
+        const std::function<void(unsigned)> *job_ = nullptr;
+        // run() bumps it to wake the helpers
+        uint64_t generation_ = 0;
+        unsigned running_ = 0;
+        bool stop_ = false;
+    };
 
     template<uint16_t YOUNG_THRESHOLD>
     struct GarbageCollector {
         class YoungArena {
-            interpreter::Value *arena = nullptr;
+            interpreter::Value *arena;
             uint16_t used = 0;
 
-            void alloc_buffer() {
-                arena = new interpreter::Value[YOUNG_THRESHOLD];
-            }
-
         public:
-            YoungArena() {
-                alloc_buffer();
+            explicit YoungArena(interpreter::Value *buffer) : arena(buffer) {
             }
 
             interpreter::Value *allocate(size_t values) {
                 assert(used + values < YOUNG_THRESHOLD);
-                if (arena == nullptr) {
-                    alloc_buffer();
-                }
-                // failed to alloc arena
-                assert(arena != nullptr);
                 auto *res = arena + used;
                 used += values;
 
                 return res;
             }
 
+            // the buffer stays mapped, the next allocations overwrite it
             void release() {
                 used = 0;
-                delete[] arena;
-                arena = nullptr;
-            }
-
-            void forget() {
-                used = 0;
-                alloc_buffer();
             }
 
             [[nodiscard]] uint16_t get_used() const {
@@ -67,27 +174,58 @@ namespace heap {
             }
         };
 
-        size_t allocated_ = 1;
+        using value_ptr = interpreter::Value *;
+        using obj_ptr_type = uint32_t;
+
+        // 4 GiB of address space, object_ptr could address up to 32 GiB
+        static constexpr size_t CAGE_CAPACITY = size_t{1} << 29;
+        // the nursery takes the first offsets of the cage, offset 0 is never an object
+        static constexpr obj_ptr_type YOUNG_BEGIN = 1;
+        static constexpr obj_ptr_type YOUNG_END = YOUNG_BEGIN + YOUNG_THRESHOLD;
+
+        HeapCage cage{CAGE_CAPACITY, YOUNG_END};
+        GcStats stats{};
 
+        // Collections follow allocation volume, counted in Values. A major gc runs once the old generation
+        // reaches old_limit, a large gc once the large objects would pass large_limit. A collection sets
+        // the limit of its generation to what survived times HEAP_GROWTH, and at least MIN_BUDGET above it
+        double HEAP_GROWTH = 2.0;
 #ifdef DEFAULT_GC_YOUNG_CAPACITY
-        size_t MAJOR_THRESHOLD = 10;
-        size_t LARGE_THRESHOLD = 10;
+        size_t MAJOR_MIN_BUDGET = 64;
+        size_t LARGE_MIN_BUDGET = 256;
 #else
         // set your own
-        size_t MAJOR_THRESHOLD = 10;
-        size_t LARGE_THRESHOLD = 10;
+        size_t MAJOR_MIN_BUDGET = size_t{1} << 16;
+        size_t LARGE_MIN_BUDGET = size_t{1} << 18;
 #endif
-
-        std::pmr::unsynchronized_pool_resource old_arena{};
+        size_t old_values = 0;
+        size_t large_values = 0;
+        // 0 until the first collection of the generation, the MIN_BUDGET applies then
+        size_t old_limit = 0;
+        size_t large_limit = 0;
+        // a major gc compacts the heap once free blocks take this share of it and at least COMPACT_MIN_FREE Values
+        bool compaction = true;
+        double COMPACT_FRAGMENTATION = 0.5;
+        size_t COMPACT_MIN_FREE = 1 << 12;
+
+        // Parallel marking: a stop-the-world mark() of at least PARALLEL_MIN_OBJECTS objects runs on
+        // mark_threads threads, the collecting one included. 1 keeps every mark serial
+        unsigned mark_threads = 1;
+        size_t PARALLEL_MIN_OBJECTS = 1 << 14;
+
+        // Incremental marking: major and large collections run as a cycle of steps of at most pause_budget,
+        // interleaved with the program at minor gcs and at poll()
+        bool incremental = false;
+        std::chrono::nanoseconds pause_budget = std::chrono::milliseconds(1);
+        // an incremental cycle is marking, write_barrier shades the stored references
+        bool marking = false;
+
+        // Set while the collector has work that no allocation may come to do, the VM calls poll()
+        // on loop back-edges then. Allocation sites collect right away
+        bool poll_pending = false;
 
         // Allocators
-        using Alloc = std::pmr::polymorphic_allocator<interpreter::Value>;
-        YoungArena young_alloc = YoungArena();
-        Alloc large_alloc{std::pmr::new_delete_resource()};
-        Alloc old_alloc{&old_arena};
-
-        using value_ptr = interpreter::Value *;
-        using obj_ptr_type = uint32_t;
+        YoungArena young_alloc{cage.at(YOUNG_BEGIN)};
 
         struct YoungRoot {
             value_ptr roots[YOUNG_THRESHOLD]{};
@@ -114,15 +252,13 @@ namespace heap {
         using DynamicRoot = std::vector<value_ptr>; // no way :(
         YoungRoot young_roots = YoungRoot();
         DynamicRoot large_roots;
-        // std::unordered_set<uint32_t>
-        // DynamicRoot old_roots;
         std::vector<obj_ptr_type> old_roots;
 
         interpreter::Value *stack_;
-        std::stack<interpreter::CallFrame> *call_stack_;
+        interpreter::CallStack *call_stack_;
         uint32_t *fp_;
 
-        void init(interpreter::Value *stack, std::stack<interpreter::CallFrame> *call_stack, uint32_t *fp) {
+        void init(interpreter::Value *stack, interpreter::CallStack *call_stack, uint32_t *fp) {
             stack_ = stack;
             call_stack_ = call_stack;
             fp_ = fp;
@@ -136,13 +272,25 @@ namespace heap {
             return (fp_ ? *fp_ : 0) + call_stack_->top().cur_func->max_stack;
         }
 
+        // header of the object named by object_ptr
+        [[nodiscard]] value_ptr resolve(const obj_ptr_type obj_ptr) const {
+            return cage.at(obj_ptr);
+        }
+
+        [[nodiscard]] static bool is_young(const obj_ptr_type obj_ptr) {
+            return obj_ptr >= YOUNG_BEGIN && obj_ptr < YOUNG_END;
+        }
+
+        // objects not freed yet, dead ones included until their generation is collected
+        [[nodiscard]] size_t live_objects() {
+            return young_roots.size() + old_roots.size() + large_roots.size();
+        }
+
         // reserve len + 1 objects to young arena
         value_ptr alloc_young(const std::size_t len) {
             value_ptr ptr = young_alloc.allocate(len + 1);
             assert(ptr);
-            ptr->object_ptr = allocated_;
-            mem.insert({allocated_, ptr});
-            allocated_++;
+            ptr->object_ptr = cage.offset_of(ptr);
             ptr->set_array(len, ptr);
             young_roots.push_back(ptr);
             return ptr;
@@ -150,12 +298,14 @@ namespace heap {
 
         // reserve huge array len + 1
         value_ptr alloc_large(const std::size_t len) {
-            value_ptr ptr = large_alloc.allocate(len + 1);
-            ptr->object_ptr = allocated_;
-            mem.insert({allocated_, ptr});
-            allocated_++;
+            const obj_ptr_type obj_ptr = cage.allocate(len + 1);
+            value_ptr ptr = resolve(obj_ptr);
+            ptr->object_ptr = obj_ptr;
             ptr->set_array(len, ptr);
+            // allocated black, the barrier shades what is stored into it
+            if (marking) set_mark(obj_ptr);
             large_roots.push_back(ptr);
+            large_values += len + 1;
             return ptr;
         }
 
@@ -164,148 +314,499 @@ namespace heap {
             young_alloc.release();
         }
 
-        void mark(value_ptr ptr) const {
-            if (ptr->is_marked()) return;
+        // Grey objects of the running mark: reached, marked once they are popped
+        std::vector<value_ptr> mark_stack;
+        // the mark stack does not grow past this many entries, the references that do not fit
+        // are found again by rescan_marked()
+        size_t mark_stack_limit = size_t{1} << 20;
+        bool mark_overflow = false;
 
-            uint32_t len = ptr->get_len();
-            ptr->mark();
-            for (int i = 1; i < len + 1; ++i) {
-                auto *neigh = ptr + i;
-                if (neigh->is_array()) {
-                    auto *obj_neigh = mem.at(neigh->object_ptr);
-                    assert(obj_neigh != ptr + i);
-                    mark(obj_neigh);
+        // Mark bits live beside the heap, a bit per cage offset: marking never writes to an object
+        // and clearing the marks is a fill of the bitmap
+        std::vector<uint64_t> mark_bits;
+
+        [[nodiscard]] bool is_marked(const obj_ptr_type obj_ptr) const {
+            const size_t word = obj_ptr >> 6;
+            return word < mark_bits.size() && (mark_bits[word] >> (obj_ptr & 63) & 1);
+        }
+
+        // false if obj_ptr was marked already
+        bool set_mark(const obj_ptr_type obj_ptr) {
+            const size_t word = obj_ptr >> 6;
+            if (word >= mark_bits.size()) {
+                mark_bits.resize((cage.top() >> 6) + 1);
+            }
+            const uint64_t bit = uint64_t{1} << (obj_ptr & 63);
+            if (mark_bits[word] & bit) return false;
+            mark_bits[word] |= bit;
+            return true;
+        }
+
+        // Card table over the cage outside the nursery, a card of 1 << CARD_SHIFT Values is dirty
+        // when a reference to a young object was stored into it since the last minor gc
+        static constexpr uint32_t CARD_SHIFT = 6;
+        std::vector<uint8_t> cards;
+        std::vector<uint32_t> dirty_cards;
+
+        // Write barrier for the store of val into the heap slot at offset slot
+        void write_barrier(const obj_ptr_type slot, const interpreter::Value &val) {
+            // Dijkstra's barrier: a black object never points to a white one
+            if (marking && val.is_array() && !is_young(val.object_ptr)) {
+                push_grey(val.object_ptr);
+            }
+            if (val.is_array() && is_young(val.object_ptr) && !is_young(slot)) {
+                const uint32_t card = slot >> CARD_SHIFT;
+                if (card >= cards.size()) {
+                    cards.resize((cage.top() >> CARD_SHIFT) + 1);
+                }
+                if (!cards[card]) {
+                    cards[card] = 1;
+                    dirty_cards.push_back(card);
                 }
             }
         }
 
-        template<class T>
-        void unmark(typename std::vector<T *>::iterator begin, typename std::vector<T *>::iterator end) {
-            std::for_each(begin, end, [](auto ptr) { ptr->unmark(); });
+        void clear_cards() {
+            for (auto card: dirty_cards) {
+                cards[card] = 0;
+            }
+            dirty_cards.clear();
         }
 
-        void mark() const {
-            assert(stack_ != nullptr || get_sp() == 0);
-            try {
-                for (int i = 0; i < get_sp(); ++i) {
-                    if (stack_[i].is_array()) {
-                        auto *ptr = mem.at(stack_[i].object_ptr);
-                        ptr->unmark();
-                        mark(ptr);
-                    }
+        void push_grey(const obj_ptr_type obj_ptr) {
+            // young objects move at every minor gc, an incremental cycle takes them as roots instead
+            if (marking && is_young(obj_ptr)) return;
+            if (mark_stack.size() == mark_stack_limit) {
+                mark_overflow = true;
+                return;
+            }
+            value_ptr ptr = resolve(obj_ptr);
+            // the header is read when the entry is popped, usually after the siblings above it
+            COTE_PREFETCH(ptr);
+            mark_stack.push_back(ptr);
+        }
+
+        // skip_marked reads every field header right away, the rescan uses it so marked fields do not fill the stack
+        void scan(value_ptr ptr, bool skip_marked = false) {
+            const auto len = ptr->get_len();
+            for (uint32_t i = 1; i < len + 1; ++i) {
+                if (ptr[i].is_array() && !(skip_marked && is_marked(ptr[i].object_ptr))) {
+                    assert(resolve(ptr[i].object_ptr) != ptr + i);
+                    push_grey(ptr[i].object_ptr);
                 }
-            } catch (std::runtime_error &e) {
-                std::cerr << e.what() << std::endl;
-                exit(1);
             }
         }
 
-        std::unordered_set<uint32_t> vis;
+        void drain_mark_stack() {
+            while (!mark_stack.empty()) {
+                value_ptr ptr = mark_stack.back();
+                mark_stack.pop_back();
+                if (!set_mark(cage.offset_of(ptr))) continue;
+                scan(ptr);
+            }
+        }
 
-        void rebind_mem(value_ptr ptr) {
-            if (vis.contains(ptr->object_ptr)) return;
-            assert(ptr->is_array());
-            vis.insert(ptr->object_ptr);
-            value_ptr old = old_alloc.allocate(ptr->get_len() + 1);
-            *old = *ptr;
-            // rebind mem
-            mem[ptr->object_ptr] = old;
-            const auto len = ptr->get_len();
-            for (int i = 1; i < len + 1; ++i) {
-                old[i] = ptr[i];
-                if (!ptr[i].is_array()) {
-                    continue;
+        // Fills the stack slots that hold roots, the VM walks its frames with their stack maps.
+        // Without it every slot below get_sp() is a root
+        std::function<void(std::vector<uint32_t> &)> stack_roots;
+        std::vector<uint32_t> root_slots;
+
+        template<class F>
+        void for_each_stack_root(F f) {
+            if (!stack_roots) {
+                for (uint32_t i = 0; i < get_sp(); ++i) {
+                    f(stack_[i]);
                 }
-                value_ptr obj;
-                try {
-                    obj = mem.at(ptr[i].object_ptr);
-                } catch (std::runtime_error &e) {
-                    std::cerr << e.what() << std::endl;
-                    exit(EXIT_FAILURE);
+                return;
+            }
+            root_slots.clear();
+            stack_roots(root_slots);
+            for (auto slot: root_slots) {
+                f(stack_[slot]);
+            }
+        }
+
+        // every slot of the dirty cards, the old objects that may point into the nursery
+        template<class F>
+        void for_each_card_slot(F f) {
+            for (auto card: dirty_cards) {
+                const obj_ptr_type begin = std::max(card << CARD_SHIFT, YOUNG_END);
+                const obj_ptr_type end = std::min((card + 1) << CARD_SHIFT, cage.top());
+                for (obj_ptr_type slot = begin; slot < end; ++slot) {
+                    f(*resolve(slot));
                 }
-                // use to handle cycling:
-                // assert(ptr[i].object_ptr != ptr->object_ptr);
-                rebind_mem(obj);
             }
-            old_roots.push_back(old->object_ptr);
         }
 
-        void minor_gc() {
-            for (uint16_t i = 0; i < young_roots.size(); ++i) {
-                auto *ptr = young_roots[i];
-                ptr->unmark();
+        void push_roots(bool skip_marked) {
+            auto push = [this, skip_marked](interpreter::Value &ref) {
+                if (ref.is_array() && !(skip_marked && is_marked(ref.object_ptr))) {
+                    push_grey(ref.object_ptr);
+                }
+            };
+            for_each_stack_root(push);
+            if (marking) {
+                for (uint16_t i = 0; i < young_roots.size(); ++i) {
+                    const auto len = young_roots[i]->get_len();
+                    std::for_each(young_roots[i] + 1, young_roots[i] + len + 1, push);
+                }
             }
-            mark();
-            // throw survivors to old arena
-            vis.clear();
+        }
+
+        template<class F>
+        void for_each_object(F f) {
             for (uint16_t i = 0; i < young_roots.size(); ++i) {
-                if (auto *ptr = young_roots[i]; ptr->is_marked()) {
-                    assert(ptr != nullptr);
-                    ptr->unmark();
-                    this->rebind_mem(ptr);
+                f(young_roots[i]);
+            }
+            for (auto obj_ptr: old_roots) {
+                f(resolve(obj_ptr));
+            }
+            std::for_each(ALL(large_roots), f);
+        }
+
+        // A reference dropped by a full mark stack leaves a root or a marked object with an unmarked field,
+        // scanning them again pushes it
+        void rescan_marked() {
+            while (mark_overflow) {
+                mark_overflow = false;
+                push_roots(true);
+                drain_mark_stack();
+                for_each_object([this](value_ptr ptr) {
+                    if (is_marked(cage.offset_of(ptr))) {
+                        scan(ptr, true);
+                        drain_mark_stack();
+                    }
+                });
+            }
+        }
+
+        // Marks everything reachable from the stack, the bitmap is clear between collections
+        void mark() {
+            assert(stack_ != nullptr || get_sp() == 0);
+            if (mark_threads > 1 && !marking && live_objects() >= PARALLEL_MIN_OBJECTS) {
+                mark_parallel();
+                return;
+            }
+            push_roots(false);
+            drain_mark_stack();
+            rescan_marked();
+        }
+
+        // Created by the first parallel mark, recreated when mark_threads changes
+        std::unique_ptr<MarkerPool> markers;
+
+        // Each marker drains a private stack and shares its oldest entries through its StealDeque while that is
+        // empty, an idle one pops its own deque or steals from the top of another. An object is claimed by
+        // setting its bit atomically, so every object is scanned once. The mark stack limit does not apply here
+        void mark_parallel() {
+            static constexpr size_t SHARE_BATCH = 64;
+            const unsigned n = mark_threads;
+            if (!markers || markers->size() != n) {
+                markers = std::make_unique<MarkerPool>(n);
+            }
+            // the bitmap cannot grow while the markers run
+            mark_bits.resize(std::max(mark_bits.size(), size_t{cage.top() >> 6} + 1));
+            std::vector<value_ptr> roots;
+            for_each_stack_root([&](interpreter::Value &ref) {
+                if (ref.is_array()) roots.push_back(resolve(ref.object_ptr));
+            });
+            std::atomic<unsigned> idle = 0;
+
+            auto steal = [this, n](unsigned id) -> value_ptr {
+                for (unsigned i = 1; i < n; ++i) {
+                    if (value_ptr ptr = markers->deque((id + i) % n).steal()) return ptr;
+                }
+                return nullptr;
+            };
+            auto worker = [&, this](unsigned id) {
+                StealDeque &own = markers->deque(id);
+                std::vector<value_ptr> local;
+                for (size_t i = id; i < roots.size(); i += n) {
+                    local.push_back(roots[i]);
+                }
+                while (true) {
+                    while (!local.empty()) {
+                        value_ptr ptr = local.back();
+                        local.pop_back();
+                        const obj_ptr_type obj_ptr = cage.offset_of(ptr);
+                        const uint64_t bit = uint64_t{1} << (obj_ptr & 63);
+                        std::atomic_ref<uint64_t> word(mark_bits[obj_ptr >> 6]);
+                        if (word.fetch_or(bit, std::memory_order_relaxed) & bit) continue;
+                        const uint32_t len = ptr->get_len();
+                        for (uint32_t i = 1; i < len + 1; ++i) {
+                            if (ptr[i].is_array()) {
+                                value_ptr child = resolve(ptr[i].object_ptr);
+                                COTE_PREFETCH(child);
+                                local.push_back(child);
+                            }
+                        }
+                        if (local.size() >= 2 * SHARE_BATCH && own.empty()) {
+                            size_t shared = 0;
+                            while (shared < SHARE_BATCH && own.push(local[shared])) shared++;
+                            local.erase(local.begin(), local.begin() + static_cast<std::ptrdiff_t>(shared));
+                        }
+                    }
+                    if (value_ptr ptr = own.pop(); ptr != nullptr || (ptr = steal(id)) != nullptr) {
+                        local.push_back(ptr);
+                        continue;
+                    }
+                    // only owners push, so once every marker is idle with an empty deque nothing is left
+                    idle++;
+                    while (true) {
+                        if (idle == n) return;
+                        if (std::any_of(ALL(markers->deques()), [](const StealDeque &d) { return !d.empty(); })) {
+                            idle--;
+                            if (value_ptr ptr = steal(id)) {
+                                local.push_back(ptr);
+                                break;
+                            }
+                            idle++;
+                        }
+                        std::this_thread::yield();
+                    }
+                }
+            };
+            markers->run(worker);
+        }
+
+        void clear_marks() {
+            std::fill(ALL(mark_bits), 0);
+        }
+
+        // Copies a young object to the old generation, its young header keeps the offset of the copy
+        void promote(value_ptr ptr) {
+            const auto len = ptr->get_len();
+            const obj_ptr_type to = cage.allocate(len + 1);
+            value_ptr old = resolve(to);
+            std::copy(ptr, ptr + len + 1, old);
+            old->object_ptr = to;
+            ptr->object_ptr = to;
+            old_roots.push_back(to);
+            old_values += len + 1;
+            if (marking) push_grey(to);
+        }
+
+        // Points a reference into the nursery at the promoted copy of its object, promoting it on first sight.
+        // A young header names itself until the object is promoted, then it is the forwarding pointer
+        void evacuate(interpreter::Value &ref) {
+            if (!ref.is_array() || !is_young(ref.object_ptr)) return;
+            value_ptr ptr = resolve(ref.object_ptr);
+            if (ptr->object_ptr == ref.object_ptr) {
+                promote(ptr);
+            }
+            ref.object_ptr = ptr->object_ptr;
+        }
+
+        // Collects the nursery alone with Cheney's scan: the roots are the stack and the dirty cards, any other
+        // store of a young reference outside the nursery went through write_barrier. Survivors are copied to
+        // the old generation, and the copies appended to old_roots are the queue of objects left to scan,
+        // so the cost follows the live young objects and the dirty cards
+        void minor_gc() {
+            stats.minor++;
+            size_t scan_at = old_roots.size();
+            auto evacuate_ref = [this](interpreter::Value &ref) { evacuate(ref); };
+            for_each_stack_root(evacuate_ref);
+            for_each_card_slot(evacuate_ref);
+            for (; scan_at < old_roots.size(); ++scan_at) {
+                value_ptr ptr = resolve(old_roots[scan_at]);
+                const auto len = ptr->get_len();
+                for (uint32_t i = 1; i < len + 1; ++i) {
+                    evacuate(ptr[i]);
                 }
             }
 
+            clear_cards();
             reset_young();
 
-            if (old_roots.size() >= MAJOR_THRESHOLD) {
+            if (marking) {
+                mark_step();
+            } else if (old_values >= std::max(old_limit, MAJOR_MIN_BUDGET)) {
                 major_gc();
             }
         }
 
-        void large_gc() {
-            unmark<interpreter::Value>(ALL(large_roots));
-            mark();
-            // mb rewrite later
+        // the next limit of a generation that keeps live Values
+        [[nodiscard]] size_t next_limit(const size_t live, const size_t min_budget) const {
+            return std::max(static_cast<size_t>(static_cast<double>(live) * HEAP_GROWTH), live + min_budget);
+        }
+
+        void sweep_large() {
             DynamicRoot keep_large;
+            large_values = 0;
             for (auto hdr: large_roots) {
-                if (hdr->is_marked()) {
-                    hdr->unmark();
+                if (is_marked(hdr->object_ptr)) {
                     keep_large.push_back(hdr);
+                    large_values += hdr->get_len() + 1;
                 } else {
-                    mem.erase(hdr->object_ptr);
-                    large_alloc.deallocate(hdr, hdr->get_len() + 1);
+                    cage.deallocate(hdr->object_ptr, hdr->get_len() + 1);
                 }
             }
             large_roots.swap(keep_large);
+            large_limit = next_limit(large_values, LARGE_MIN_BUDGET);
         }
 
-        void major_gc() {
-            // unmark<obj_ptr_type>(ALL(old_roots));
-            for (value_ptr ptr: old_roots
-                                | std::ranges::views::transform(
-                    [](const uint32_t obj_ptr) -> value_ptr {
-                        return mem.at(obj_ptr);
-                    })
-                    ) { ptr->unmark(); }
-
-            mark();
-            // mb rewrite later
-            std::vector<uint32_t> survivors;
+        void sweep_old() {
+            std::vector<obj_ptr_type> survivors;
+            old_values = 0;
             for (auto obj_ptr: old_roots) {
-                auto *ptr = mem.at(obj_ptr);
-                if (ptr->is_marked()) {
-                    ptr->unmark();
+                auto *ptr = resolve(obj_ptr);
+                if (is_marked(obj_ptr)) {
                     survivors.push_back(obj_ptr);
+                    old_values += ptr->get_len() + 1;
                 } else {
-                    mem.erase(ptr->object_ptr);
-                    old_alloc.deallocate(ptr, ptr->get_len() + 1);
+                    cage.deallocate(obj_ptr, ptr->get_len() + 1);
                 }
             }
             old_roots.swap(survivors); // constant complexity :)
+            old_limit = next_limit(old_values, MAJOR_MIN_BUDGET);
         }
 
-        GarbageCollector() : stack_(nullptr), call_stack_(nullptr), fp_(nullptr) {
+        void large_gc() {
+            if (incremental) {
+                marking ? mark_step() : start_cycle();
+                return;
+            }
+            stats.large++;
+            mark();
+            sweep_large();
+            clear_marks();
         }
 
-        value_ptr alloc_array(const size_t len) {
-            if (large_roots.size() >= LARGE_THRESHOLD) {
-                large_gc();
+        void major_gc() {
+            if (incremental) {
+                marking ? mark_step() : start_cycle();
+                return;
+            }
+            stats.major++;
+            mark();
+            sweep_old();
+            if (should_compact()) {
+                compact();
             }
+            clear_marks();
+        }
+
+        // An incremental cycle collects the old and the large objects at once
+        void start_cycle() {
+            stats.major++;
+            marking = true;
+            poll_pending = true;
+            push_roots(false);
+            mark_step();
+        }
 
+        // Marks for at most pause_budget, the step that runs out of grey objects finishes the cycle
+        void mark_step() {
+            using clock = std::chrono::steady_clock;
+            const auto start = clock::now();
+            stats.mark_steps++;
+            size_t scanned = 0;
+            while (!mark_stack.empty()) {
+                value_ptr ptr = mark_stack.back();
+                mark_stack.pop_back();
+                if (!set_mark(cage.offset_of(ptr))) continue;
+                scan(ptr);
+                if (++scanned % 64 == 0 && clock::now() - start >= pause_budget) break;
+            }
+            if (mark_stack.empty()) {
+                finish_cycle();
+            }
+            const auto us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+            stats.max_step_us = std::max<uint64_t>(stats.max_step_us, us);
+        }
+
+        // The stack and the nursery are written without the barrier, so they are scanned once more
+        // before the white objects are freed
+        void finish_cycle() {
+            push_roots(false);
+            drain_mark_stack();
+            rescan_marked();
+            marking = false;
+            poll_pending = false;
+            sweep_old();
+            sweep_large();
+            if (should_compact()) {
+                compact();
+            }
+            clear_marks();
+        }
+
+        // The nursery has to be empty: young objects would need their fields and the cards updated too
+        [[nodiscard]] bool should_compact() const {
+            return compaction && young_alloc.get_used() == 0 && dirty_cards.empty()
+                   && cage.free_values() >= COMPACT_MIN_FREE && cage.fragmentation() >= COMPACT_FRAGMENTATION;
+        }
+
+        // Sliding compaction (Lisp 2) of the old and large objects right after a mark: every marked object moves
+        // down to the lowest free offset, keeping the address order, and the dead ones vanish
+        void compact() {
+            stats.compactions++;
+            stats.fragmentation_before = cage.fragmentation();
+            std::vector<obj_ptr_type> live(old_roots);
+            const size_t old_count = live.size();
+            for (auto hdr: large_roots) {
+                if (is_marked(hdr->object_ptr)) live.push_back(hdr->object_ptr);
+            }
+            std::vector<bool> is_large(live.size());
+            std::fill(is_large.begin() + old_count, is_large.end(), true);
+            std::vector<size_t> order(live.size());
+            std::iota(ALL(order), 0);
+            std::sort(ALL(order), [&live](size_t i, size_t j) { return live[i] < live[j]; });
+
+            // the header of an object keeps its new offset until it is moved
+            obj_ptr_type top = YOUNG_END;
+            for (auto i: order) {
+                value_ptr ptr = resolve(live[i]);
+                ptr->object_ptr = top;
+                top += ptr->get_len() + 1;
+            }
+            auto relocate = [this](interpreter::Value &ref) {
+                if (ref.is_array() && !is_young(ref.object_ptr)) ref.object_ptr = resolve(ref.object_ptr)->object_ptr;
+            };
+            for_each_stack_root(relocate);
+            for (auto obj_ptr: live) {
+                value_ptr ptr = resolve(obj_ptr);
+                const auto len = ptr->get_len();
+                for (uint32_t i = 1; i < len + 1; ++i) {
+                    relocate(ptr[i]);
+                }
+            }
+
+            // moving up to down never overwrites an object that is not moved yet
+            old_roots.clear();
+            large_roots.clear();
+            large_values = 0;
+            for (auto i: order) {
+                value_ptr from = resolve(live[i]);
+                value_ptr to = resolve(from->object_ptr);
+                std::memmove(static_cast<void *>(to), from, (from->get_len() + 1) * sizeof(interpreter::Value));
+                if (is_large[i]) {
+                    large_roots.push_back(to);
+                    large_values += to->get_len() + 1;
+                } else {
+                    old_roots.push_back(to->object_ptr);
+                }
+            }
+            // the dead large objects are gone as after sweep_large, a major gc without a cycle does not sweep them
+            large_limit = next_limit(large_values, LARGE_MIN_BUDGET);
+            cage.shrink_to(top);
+            stats.fragmentation_after = cage.fragmentation();
+        }
+
+        GarbageCollector() : stack_(nullptr), call_stack_(nullptr), fp_(nullptr) {
+        }
+
+        GarbageCollector(const GarbageCollector &) = delete;
+
+        GarbageCollector &operator=(const GarbageCollector &) = delete;
+
+        value_ptr alloc_array(const size_t len) {
             value_ptr ptr;
 
             if (len + 1 >= YOUNG_THRESHOLD) {
+                if (large_values + len + 1 > std::max(large_limit, LARGE_MIN_BUDGET)) {
+                    large_gc();
+                }
                 ptr = alloc_large(len);
                 for (int i = 1; i < len + 1; ++i) {
                     ptr[i].set_nil();
@@ -327,16 +828,34 @@ namespace heap {
         void call(
                 // interpreter::Value *stack, const uint32_t sp
         ) {
+            if (incremental) {
+                marking ? mark_step() : start_cycle();
+                return;
+            }
             large_gc();
             major_gc();
         }
 
+        // Safepoint of a loop back-edge: the stack roots have to be current, as at an allocation
+        void poll() {
+            if (marking) mark_step();
+        }
+
+        // Frees every object, the collector can then be reused for another program
         void cleanup() {
-            mem.clear();
+            cage.release();
             reset_young();
             old_roots.clear();
             large_roots.clear();
-            vis.clear();
+            clear_cards();
+            mark_stack.clear();
+            mark_overflow = false;
+            mark_bits.clear();
+            marking = false;
+            poll_pending = false;
+            old_values = large_values = 0;
+            old_limit = large_limit = 0;
+            stats = GcStats{};
         }
     };
 } // heap
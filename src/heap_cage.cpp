@@ -0,0 +1,104 @@
+//
+// Address space of the GC heap
+//
+
+#include "heap_cage.h"
+
+#include <cassert>
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define COTE_MMAP_HEAP 1
+#else
+#define COTE_MMAP_HEAP 0
+#endif
+
+using interpreter::Value;
+
+heap::HeapCage::HeapCage(size_t capacity, uint32_t reserved)
+    : capacity_(capacity), reserved_(reserved), top_(reserved), small_free_(SMALL_BLOCKS) {
+    if (capacity > (size_t{1} << 32) || reserved > capacity) {
+        throw std::runtime_error("heap cage does not fit 32-bit offsets");
+    }
+#if COTE_MMAP_HEAP
+    mapped_bytes_ = capacity * sizeof(Value);
+    void *mem = mmap(nullptr, mapped_bytes_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("cannot reserve heap cage");
+    }
+    base_ = static_cast<Value *>(mem);
+#else
+    base_ = new Value[capacity]();
+#endif
+}
+
+heap::HeapCage::~HeapCage() {
+#if COTE_MMAP_HEAP
+    munmap(base_, mapped_bytes_);
+#else
+    delete[] base_;
+#endif
+}
+
+uint32_t heap::HeapCage::allocate(uint32_t values) {
+    if (values < SMALL_BLOCKS) {
+        if (auto &bin = small_free_[values]; !bin.empty()) {
+            const uint32_t res = bin.back();
+            bin.pop_back();
+            free_values_ -= values;
+            return res;
+        }
+    } else if (auto it = large_free_.lower_bound(values); it != large_free_.end()) {
+        const auto [size, res] = *it;
+        large_free_.erase(it);
+        free_values_ -= size;
+        if (size > values) {
+            deallocate(res + values, size - values);
+        }
+        return res;
+    }
+    if (top_ + static_cast<size_t>(values) > capacity_) {
+        throw std::runtime_error("heap cage is exhausted");
+    }
+    const uint32_t res = top_;
+    top_ += values;
+    return res;
+}
+
+void heap::HeapCage::deallocate(uint32_t offset, uint32_t values) {
+    free_values_ += values;
+    if (values < SMALL_BLOCKS) {
+        small_free_[values].push_back(offset);
+        return;
+    }
+    // big dead arrays should not keep their pages resident until the block is reused
+    decommit(offset, offset + values);
+    large_free_.emplace(values, offset);
+}
+
+void heap::HeapCage::release() {
+    shrink_to(reserved_);
+}
+
+void heap::HeapCage::shrink_to(uint32_t new_top) {
+    assert(new_top >= reserved_ && new_top <= top_);
+    decommit(new_top, top_);
+    top_ = new_top;
+    for (auto &bin: small_free_) bin.clear();
+    large_free_.clear();
+    free_values_ = 0;
+}
+
+void heap::HeapCage::decommit(uint32_t from, uint32_t to) {
+#if COTE_MMAP_HEAP
+    const auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const auto begin = (reinterpret_cast<uintptr_t>(at(from)) + page - 1) / page * page;
+    const auto end = reinterpret_cast<uintptr_t>(at(to)) / page * page;
+    if (begin < end) {
+        madvise(reinterpret_cast<void *>(begin), end - begin, MADV_DONTNEED);
+    }
+#endif
+}
@@ -0,0 +1,78 @@
+//
+// Address space of the GC heap
+//
+
+#ifndef COTE_HEAP_CAGE_H
+#define COTE_HEAP_CAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "value.h"
+
+namespace heap {
+    // Address space for `capacity` Values reserved once, every heap object lives inside it.
+    // An object is named by the offset of its header from the base (Value::object_ptr), so a reference
+    // is 32 bits and resolving it is a single add. The OS commits pages on first touch.
+    class HeapCage {
+    public:
+        // offsets below `reserved` are never handed out by allocate(), the collector places the nursery there
+        HeapCage(size_t capacity, uint32_t reserved);
+
+        ~HeapCage();
+
+        HeapCage(const HeapCage &) = delete;
+
+        HeapCage &operator=(const HeapCage &) = delete;
+
+        [[nodiscard]] interpreter::Value *at(uint32_t offset) const { return base_ + offset; }
+
+        [[nodiscard]] uint32_t offset_of(const interpreter::Value *ptr) const {
+            return static_cast<uint32_t>(ptr - base_);
+        }
+
+        // offset of `values` free Values, reuses freed blocks before growing the used part
+        uint32_t allocate(uint32_t values);
+
+        void deallocate(uint32_t offset, uint32_t values);
+
+        // Frees every block handed out and returns their pages to the OS
+        void release();
+
+        // Drops every free block and the space from new_top on, once the live blocks were moved below new_top
+        void shrink_to(uint32_t new_top);
+
+        // end of the used part, allocations so far lie in [reserved, top)
+        [[nodiscard]] uint32_t top() const { return top_; }
+
+        // Values of the used part held by free blocks
+        [[nodiscard]] size_t free_values() const { return free_values_; }
+
+        // share of the used part held by free blocks, 0 for a compact heap
+        [[nodiscard]] double fragmentation() const {
+            return top_ == reserved_ ? 0.0 : static_cast<double>(free_values_) / (top_ - reserved_);
+        }
+
+        [[nodiscard]] size_t capacity() const { return capacity_; }
+
+    private:
+        // returns the whole pages inside [from, to) to the OS, they read as zeroes afterwards
+        void decommit(uint32_t from, uint32_t to);
+
+        // free blocks are kept by exact size up to this one, bigger ones are split on reuse
+        static constexpr uint32_t SMALL_BLOCKS = 256;
+
+        interpreter::Value *base_;
+        size_t capacity_;
+        size_t mapped_bytes_ = 0;
+        uint32_t reserved_;
+        uint32_t top_;
+        size_t free_values_ = 0;
+        std::vector<std::vector<uint32_t>> small_free_;
+        std::multimap<uint32_t, uint32_t> large_free_; // size -> offset
+    };
+}
+
+#endif //COTE_HEAP_CAGE_H
@@ -18,8 +18,8 @@ namespace interpreter {
         OpCode op = static_cast<OpCode>(instr >> OPCODE_SHIFT);
 
         uint8_t a = (instr >> A_SHIFT) & A_ARG;
-        uint8_t b = (instr >> B_SHIFT) & B_ARG;
-        uint8_t c = instr & C_ARG;
+        uint16_t b = (instr >> B_SHIFT) & B_ARG;
+        uint16_t c = instr & C_ARG;
         uint32_t bx = instr & BX_ARG;
         switch (op) {
             case OP_LOADINT:
@@ -57,7 +57,7 @@ namespace interpreter {
             case OP_LE:
                 return std::format("leq [{}] [{}] [{}]", a, b, c);
             case OP_JMP: {
-                return std::format("jmp {}", (int32_t) bx - (int32_t) J_ZERO);
+                return std::format("jmp {}", jump_offset(instr));
             }
             case OP_JMPT: {
                 return std::format("jmpt [{}] {}", a, (int32_t) bx - (int32_t) J_ZERO);
@@ -89,7 +89,71 @@ namespace interpreter {
             case OP_ARRSET:
                 return std::format("arrset [{}][{}] [{}]", a, b, c);
             case OP_TAILCALL:
-                return std::format("tailcall [{}]", a);
+                return std::format("tailcall [{}] [{}]...[{}]", a, b, b + c - 1);
+            case OP_JEQ:
+                return std::format("jeq [{}] [{}]", b, c);
+            case OP_JNE:
+                return std::format("jne [{}] [{}]", b, c);
+            case OP_JLT:
+                return std::format("jlt [{}] [{}]", b, c);
+            case OP_JLE:
+                return std::format("jle [{}] [{}]", b, c);
+            case OP_JNLT:
+                return std::format("jnlt [{}] [{}]", b, c);
+            case OP_JNLE:
+                return std::format("jnle [{}] [{}]", b, c);
+            case OP_ADDI:
+                return std::format("addi [{}] [{}] {}", a, b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_SUBI:
+                return std::format("subi [{}] [{}] {}", a, b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_MULI:
+                return std::format("muli [{}] [{}] {}", a, b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_ADDK:
+                return std::format("addk [{}] [{}] K[{}]", a, b, c);
+            case OP_SUBK:
+                return std::format("subk [{}] [{}] K[{}]", a, b, c);
+            case OP_MULK:
+                return std::format("mulk [{}] [{}] K[{}]", a, b, c);
+            case OP_DIVK:
+                return std::format("divk [{}] [{}] K[{}]", a, b, c);
+            case OP_MODK:
+                return std::format("modk [{}] [{}] K[{}]", a, b, c);
+            case OP_EQI:
+                return std::format("{}eqi [{}] {}", a ? "n" : "", b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_LTI:
+                return std::format("{}lti [{}] {}", a ? "n" : "", b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_LEI:
+                return std::format("{}lei [{}] {}", a ? "n" : "", b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_GTI:
+                return std::format("{}gti [{}] {}", a ? "n" : "", b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_GEI:
+                return std::format("{}gei [{}] {}", a ? "n" : "", b, (int32_t) c - (int32_t) IMM_ZERO);
+            case OP_ADD_II:
+                return std::format("add_ii [{}] [{}] [{}]", a, b, c);
+            case OP_ADD_FF:
+                return std::format("add_ff [{}] [{}] [{}]", a, b, c);
+            case OP_SUB_II:
+                return std::format("sub_ii [{}] [{}] [{}]", a, b, c);
+            case OP_SUB_FF:
+                return std::format("sub_ff [{}] [{}] [{}]", a, b, c);
+            case OP_MUL_II:
+                return std::format("mul_ii [{}] [{}] [{}]", a, b, c);
+            case OP_MUL_FF:
+                return std::format("mul_ff [{}] [{}] [{}]", a, b, c);
+            case OP_LT_II:
+                return std::format("lt_ii [{}] [{}] [{}]", a, b, c);
+            case OP_LE_II:
+                return std::format("leq_ii [{}] [{}] [{}]", a, b, c);
+            case OP_JLT_II:
+                return std::format("jlt_ii [{}] [{}]", b, c);
+            case OP_JLE_II:
+                return std::format("jle_ii [{}] [{}]", b, c);
+            case OP_JNLT_II:
+                return std::format("jnlt_ii [{}] [{}]", b, c);
+            case OP_JNLE_II:
+                return std::format("jnle_ii [{}] [{}]", b, c);
+            case OP_EXTRAARG:
+                return std::format("extraarg {}", instr & AX_ARG);
         }
     }
 }
@@ -14,6 +14,293 @@
 #include "ins_to_string.h"
 
 namespace {
+    // at most this many VM registers live in machine registers, the rest of the GPRs are temporaries
+    constexpr size_t MAX_PROMOTED = 8;
+
+    // VM registers worth keeping in machine registers: the most used ones, a use weighing 4 times more
+    // per loop around it
+    std::vector<int> choose_promoted(const interpreter::VMData &vm, const interpreter::Function &func) {
+        using namespace interpreter;
+        const int n = static_cast<int>(func.code_size);
+        std::vector<int> depth(n + 1);
+        for (int i = 0; i < n; i++) {
+            const uint32_t instr = vm.code[func.entry_point + i];
+            const auto opcode = static_cast<OpCode>(instr >> OPCODE_SHIFT);
+            int target = n;
+            if (opcode == OP_JMP) target = i + 1 + jump_offset(instr);
+            // a self tail call loops over the whole function
+            if (opcode == OP_TAILCALL) target = 0;
+            if (target <= i) {
+                depth[target]++;
+                depth[i + 1]--;
+            }
+        }
+        std::vector<uint64_t> weight(func.max_stack);
+        uint32_t ax = 0;
+        for (int i = 0, d = 0; i < n; i++) {
+            d += depth[i];
+            const uint32_t instr = vm.code[func.entry_point + i];
+            const auto op = unquickened(static_cast<OpCode>(instr >> OPCODE_SHIFT));
+            if (op == OP_EXTRAARG) {
+                ax = instr & AX_ARG;
+                continue;
+            }
+            const uint32_t a = wide_a(instr, ax), b = wide_b(instr, ax), c = wide_c(instr, ax);
+            ax = 0;
+            const uint64_t w = uint64_t{1} << std::min(2 * d, 40);
+            auto use = [&](uint32_t r) {
+                if (r < weight.size()) weight[r] += w;
+            };
+            switch (op) {
+                case OP_LOADINT:
+                case OP_LOADNIL:
+                case OP_LOADFUNC:
+                case OP_LOADFLOAT:
+                case OP_JMPT:
+                case OP_JMPF:
+                case OP_RETURN:
+                    use(a);
+                    break;
+                case OP_MOVE:
+                case OP_NEG:
+                case OP_ADDI:
+                case OP_SUBI:
+                case OP_MULI:
+                case OP_ADDK:
+                case OP_SUBK:
+                case OP_MULK:
+                case OP_DIVK:
+                case OP_MODK:
+                    use(a);
+                    use(b);
+                    break;
+                case OP_ADD:
+                case OP_SUB:
+                case OP_MUL:
+                case OP_DIV:
+                case OP_MOD:
+                case OP_EQ:
+                case OP_NEQ:
+                case OP_LT:
+                case OP_LE:
+                case OP_ARRGET:
+                case OP_ARRSET:
+                    use(a);
+                    use(b);
+                    use(c);
+                    break;
+                case OP_JEQ:
+                case OP_JNE:
+                case OP_JLT:
+                case OP_JLE:
+                case OP_JNLT:
+                case OP_JNLE:
+                    use(b);
+                    use(c);
+                    break;
+                case OP_EQI:
+                case OP_LTI:
+                case OP_LEI:
+                case OP_GTI:
+                case OP_GEI:
+                    use(b);
+                    break;
+                default:
+                    break;
+            }
+        }
+        std::vector<int> regs;
+        for (int r = 0; r < static_cast<int>(weight.size()); r++) {
+            if (weight[r] > 0) regs.push_back(r);
+        }
+        std::stable_sort(regs.begin(), regs.end(), [&weight](int x, int y) { return weight[x] > weight[y]; });
+        if (regs.size() > MAX_PROMOTED) regs.resize(MAX_PROMOTED);
+        return regs;
+    }
+
+    // the type_part of a constant, TYPE_UNKNOWN for an object
+    uint32_t type_of(const interpreter::Value &v) {
+        return v.is_int() || v.is_float() ? v.type_part : jit::TYPE_UNKNOWN;
+    }
+
+    // The operand type the interpreter quickened an instruction to, the code speculates on it until the
+    // function has been dropped for deopting too often
+    uint32_t observed_type(const interpreter::Function &func, uint32_t instr) {
+        using namespace interpreter;
+        if (func.deopts >= DEOPT_LIMIT) return jit::TYPE_UNKNOWN;
+        switch (static_cast<OpCode>(instr >> OPCODE_SHIFT)) {
+            case OP_ADD_II:
+            case OP_SUB_II:
+            case OP_MUL_II:
+            case OP_LT_II:
+            case OP_LE_II:
+            case OP_JLT_II:
+            case OP_JLE_II:
+            case OP_JNLT_II:
+            case OP_JNLE_II:
+                return TYPE_INT;
+            case OP_ADD_FF:
+            case OP_SUB_FF:
+            case OP_MUL_FF:
+                return TYPE_FLOAT;
+            default:
+                return jit::TYPE_UNKNOWN;
+        }
+    }
+
+    // the compare-and-branch opcodes followed by the OP_JMP holding their target
+    bool is_fused(interpreter::OpCode op) {
+        using namespace interpreter;
+        return (op >= OP_JEQ && op <= OP_JNLE) || (op >= OP_EQI && op <= OP_GEI);
+    }
+
+    // The types an instruction compiled by JitFuncInfo leaves in the registers when it does not deopt:
+    // the ones it writes and the ones of operands it only accepts of a single type. expect is the
+    // profiled operand type the code speculates on
+    void step_types(const interpreter::VMData &vm, std::vector<uint32_t> &t, interpreter::OpCode op,
+                    uint32_t a, uint32_t b, uint32_t c, uint32_t bx, uint32_t expect) {
+        using namespace interpreter;
+        // registers out of the frame, as in a function without max_stack, are never known
+        uint32_t scratch;
+        auto at = [&t, &scratch](uint32_t r) -> uint32_t & {
+            return r < t.size() ? t[r] : scratch = jit::TYPE_UNKNOWN;
+        };
+        switch (op) {
+            case OP_LOADINT:
+                at(a) = type_of(vm.constanti[bx]);
+                break;
+            case OP_LOADFLOAT:
+                at(a) = type_of(vm.constantf[bx]);
+                break;
+            case OP_LOADNIL:
+                at(a) = TYPE_NIL;
+                break;
+            case OP_LOADFUNC:
+                at(a) = TYPE_CALLABLE;
+                break;
+            case OP_MOVE:
+                at(a) = at(b);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LT:
+            case OP_LE: {
+                const uint32_t type = jit::speculated_type(at(b), at(c), expect);
+                if (type != jit::TYPE_UNKNOWN) at(b) = at(c) = type;
+                at(a) = op == OP_LT || op == OP_LE ? TYPE_INT : type;
+                break;
+            }
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JNLT:
+            case OP_JNLE: {
+                const uint32_t type = jit::speculated_type(at(b), at(c), expect);
+                if (type != jit::TYPE_UNKNOWN) at(b) = at(c) = type;
+                break;
+            }
+            case OP_MOD:
+                at(a) = at(b) = at(c) = TYPE_INT;
+                break;
+            case OP_EQ:
+            case OP_NEQ:
+                at(a) = TYPE_INT;
+                break;
+            case OP_NEG:
+                at(a) = jit::operand_type(at(b), at(b));
+                break;
+            case OP_ADDI:
+            case OP_SUBI:
+            case OP_MULI:
+                at(a) = at(b) = TYPE_INT;
+                break;
+            case OP_ADDK:
+            case OP_SUBK:
+            case OP_MULK:
+            case OP_DIVK:
+            case OP_MODK:
+                at(a) = at(b) = vm.constantk[c].is_int() ? TYPE_INT : TYPE_FLOAT;
+                break;
+            case OP_LTI:
+            case OP_LEI:
+            case OP_GTI:
+            case OP_GEI:
+                at(b) = TYPE_INT;
+                break;
+            case OP_ARRGET:
+                at(a) = jit::TYPE_UNKNOWN;
+                break;
+            case OP_NATIVE_CALL:
+                at(b) = jit::TYPE_UNKNOWN;
+                break;
+            case OP_CALL:
+            case OP_INVOKEDYNAMIC:
+                // the callee frame starts at b
+                for (uint32_t r = b; r < t.size(); r++) t[r] = jit::TYPE_UNKNOWN;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // The types every path from the entry leaves in the registers at each reached jump target, forwards to
+    // a fixpoint. The arguments and the registers not written yet are unknown
+    std::unordered_map<int, std::vector<uint32_t>> infer_types(const interpreter::VMData &vm,
+                                                              const interpreter::Function &func) {
+        using namespace interpreter;
+        std::unordered_map<int, std::vector<uint32_t>> in;
+        auto merge = [&in](int target, const std::vector<uint32_t> &t) {
+            auto [it, added] = in.emplace(target, t);
+            if (added) return true;
+            bool changed = false;
+            for (size_t r = 0; r < t.size(); r++) {
+                if (it->second[r] != t[r] && it->second[r] != jit::TYPE_UNKNOWN) {
+                    it->second[r] = jit::TYPE_UNKNOWN;
+                    changed = true;
+                }
+            }
+            return changed;
+        };
+        const int n = static_cast<int>(func.code_size);
+        for (bool changed = true; changed;) {
+            changed = false;
+            std::vector<uint32_t> t(func.max_stack, jit::TYPE_UNKNOWN);
+            bool reached = true;
+            for (int i = 0; i < n; i++) {
+                // a jump target, labels of a widened instruction are at its prefix
+                if (in.count(i)) {
+                    if (reached) changed |= merge(i, t);
+                    t = in[i];
+                    reached = true;
+                }
+                uint32_t instr = vm.code[func.entry_point + i];
+                uint32_t ax = 0;
+                if (instr >> OPCODE_SHIFT == OP_EXTRAARG) {
+                    ax = instr & AX_ARG;
+                    instr = vm.code[func.entry_point + ++i];
+                }
+                const OpCode op = unquickened(static_cast<OpCode>(instr >> OPCODE_SHIFT));
+                const uint32_t bx = wide_bx(instr, ax);
+                int target = -1;
+                bool falls = op != OP_JMP && op != OP_RETURN && op != OP_RETURNNIL && op != OP_TAILCALL &&
+                             op != OP_HALT;
+                if (op == OP_JMP) target = i + 1 + jump_offset(instr);
+                if (op == OP_JMPT || op == OP_JMPF) target = i + 1 + static_cast<int32_t>(bx - J_ZERO);
+                if (is_fused(op)) {
+                    target = i + 2 + jump_offset(vm.code[func.entry_point + i + 1]);
+                    i++;
+                }
+                if (!reached) continue;
+                step_types(vm, t, op, wide_a(instr, ax), wide_b(instr, ax), wide_c(instr, ax), bx,
+                           observed_type(func, instr));
+                if (target >= 0) changed |= merge(target, t);
+                reached = falls;
+            }
+        }
+        return in;
+    }
+
     class SimpleErrorHandler : public asmjit::ErrorHandler {
     public:
         asmjit::Error err;
@@ -44,17 +331,24 @@ jit::CompilationResult jit::JitRuntime::compile(interpreter::VMData &vm,
 
     std::unordered_map<int, Label> labels;
     int start = func.entry_point;
+    uint32_t ax = 0;
     for (int i = 0; i < func.code_size; i++) {
         const uint32_t instr = vm.code[start++];
         const auto opcode = static_cast<OpCode>(instr >> OPCODE_SHIFT);
+        if (opcode == OP_EXTRAARG) {
+            ax = instr & AX_ARG;
+            continue;
+        }
         if (opcode == OP_JMP || opcode == OP_JMPF || opcode == OP_JMPT) {
-            const int32_t sbx = static_cast<int32_t>(instr & BX_ARG) - J_ZERO;
+            const int32_t sbx = opcode == OP_JMP ? jump_offset(instr)
+                                                 : static_cast<int32_t>(wide_bx(instr, ax) - J_ZERO);
             const int loc = i + 1 + sbx;
             auto it = labels.find(loc);
             if (it == labels.end()) {
                 labels.emplace(loc, info.cc.newLabel());
             }
         }
+        ax = 0;
 
     }
     start -= func.code_size;
@@ -65,72 +359,119 @@ jit::CompilationResult jit::JitRuntime::compile(interpreter::VMData &vm,
     info.arg1 = info.cc.newUIntPtr("args*");       // Create `dst` register (destination pointer).
 
     node->setArg(0, info.arg1);
+    // the hot registers are loaded once, the instructions work on them and the calls go through the slots
+    info.promoted.resize(func.max_stack);
+    for (int r: choose_promoted(vm, func)) {
+        info.promoted[r] = info.cc.newUInt64();
+        info.reload(r);
+    }
+    const auto target_types = infer_types(vm, func);
+    info.types.assign(func.max_stack, TYPE_UNKNOWN);
+    // self tail calls jump back here
+    const Label entry = info.cc.newLabel();
+    info.cc.bind(entry);
+    const int self = static_cast<int>(&func - vm.functions.data());
+    // the function the nearest OP_LOADFUNC at or before code[from] put into reg, -1 if there is none
+    auto loaded_func = [&vm, &func](int reg, int from) {
+        for (int j = from; j >= static_cast<int>(func.entry_point); j--) {
+            const uint32_t prev = vm.code[j];
+            if (prev >> OPCODE_SHIFT != OP_LOADFUNC) continue;
+            const uint32_t prev_ax = j > static_cast<int>(func.entry_point) &&
+                                     vm.code[j - 1] >> OPCODE_SHIFT == OP_EXTRAARG
+                                     ? vm.code[j - 1] & AX_ARG : 0;
+            if (static_cast<int>(wide_a(prev, prev_ax)) == reg) return static_cast<int>(wide_bx(prev, prev_ax));
+        }
+        return -1;
+    };
+    // a call site filled with functions[idx] when it takes c arguments
+    auto call_site = [this, &vm](int idx, int c) -> CallCache & {
+        CallCache &cache = caches.emplace_back();
+        if (idx >= 0 && idx < static_cast<int>(vm.functions.size()) && vm.functions[idx].arity == c &&
+            vm.functions[idx].max_stack <= vm.stack_memory.capacity()) {
+            cache.fill(vm, idx);
+        }
+        return cache;
+    };
 
 
     for (int i = 0; i < func.code_size; i++) {
-
-//TODO: keep info about register, if it is a merge flow point, reset it. Use it to optimize type information. Basically equivalent to local basic block optimizations.
-//        auto it = merge_flow_points.find(i);
-//        if (it == merge_flow_points.end()) {
-//            info.clear();
-//        }
+        info.ip = start;
         auto it = labels.find(i);
         if (it != labels.end()) {
             info.cc.bind(it->second);
+            auto known = target_types.find(i);
+            if (known != target_types.end()) info.types = known->second;
+            else info.types.assign(func.max_stack, TYPE_UNKNOWN);
         }
 
-        const uint32_t instr = vm.code[start++];
-
+        uint32_t instr = vm.code[start++];
+        uint32_t ax = 0;
+        if (instr >> OPCODE_SHIFT == OP_EXTRAARG) {
+            // labels of a widened instruction are bound at its prefix, both are compiled as one
+            ax = instr & AX_ARG;
+            instr = vm.code[start++];
+            i++;
+        }
 
-        const uint8_t a = (instr >> A_SHIFT) & A_ARG;
-        const uint8_t b = (instr >> B_SHIFT) & B_ARG;
-        const uint8_t c = instr & C_ARG;
-        const uint32_t bx = instr & BX_ARG;
-        const int32_t sbx = static_cast<int32_t>(instr & BX_ARG) - J_ZERO;
-        const int jump_loc = i + 1 + sbx;
+        const int a = static_cast<int>(wide_a(instr, ax));
+        const int b = static_cast<int>(wide_b(instr, ax));
+        const int c = static_cast<int>(wide_c(instr, ax));
+        const uint32_t bx = wide_bx(instr, ax);
+        // a quickened opcode is the type profile the interpreter recorded for the instruction
+        const OpCode op = unquickened(static_cast<OpCode>(instr >> OPCODE_SHIFT));
+        const uint32_t expect = observed_type(func, instr);
+        const int32_t sbx = op == OP_JMP ? jump_offset(instr) : static_cast<int32_t>(bx - J_ZERO);
 //        std::cerr << ins_to_string(instr) << std::endl;
 
-        switch (static_cast<OpCode>(instr >> OPCODE_SHIFT)) {
+        // a jump to an instruction at or before this one closes a loop
+        auto backedge = [&](int target) {
+            if (target <= i) info.gc_poll(start - 1);
+        };
+
+        switch (op) {
             case interpreter::OP_ADD:
-                info.binary_operation<OP_ADD>(a, b, c);
+                info.binary_operation<OP_ADD>(a, b, c, expect);
                 break;
             case interpreter::OP_SUB:
-                info.binary_operation<OP_SUB>(a, b, c);
+                info.binary_operation<OP_SUB>(a, b, c, expect);
                 break;
             case interpreter::OP_MUL:
-                info.binary_operation<OP_MUL>(a, b, c);
+                info.binary_operation<OP_MUL>(a, b, c, expect);
                 break;
             case interpreter::OP_DIV:
-                info.binary_operation<OP_DIV>(a, b, c);
+                info.binary_operation<OP_DIV>(a, b, c, expect);
                 break;
             case OP_LT: {
-                info.binary_operation<OP_LT>(a, b, c);
+                info.binary_operation<OP_LT>(a, b, c, expect);
                 break;
             }
             case OP_LE: {
-                info.binary_operation<OP_LE>(a, b, c);
+                info.binary_operation<OP_LE>(a, b, c, expect);
                 break;
             }
             case interpreter::OP_LOADINT: {
-                auto temp = info.cc.newUInt64();
-                info.cc.movabs(temp, vm.constanti[bx].as_uint64());
-                info.cc.mov(x86::ptr(info.arg1, a * 8), temp);
+                info.set_const(a, vm.constanti[bx].as_uint64());
                 break;
             }
             case interpreter::OP_JMPF: {
-                info.cjmp<false>(a, labels[1 + i + sbx]);
+                backedge(1 + i + sbx);
+                info.truth_jump(false, a, labels[1 + i + sbx]);
                 break;
             }
             case interpreter::OP_NATIVE_CALL: {
+                // a native may collect, the stack map of this instruction describes the frame
+                auto ip = info.cc.newUIntPtr();
+                info.cc.mov(ip, &vm.ip);
+                info.cc.mov(x86::dword_ptr(ip), start - 1);
                 info.native_call3((void *) vm.natives[a], b, c);
                 break;
             }
             case interpreter::OP_CALL:
-                throw std::runtime_error("cannot compile");
+                info.call(call_site(a, c), a, b, c, start);
                 break;
             case interpreter::OP_RETURN: {
-                auto temp = info.cc.newUInt64();
-                info.cc.mov(temp, x86::qword_ptr(info.arg1, a * 8));
+                // the other registers die with the frame, only the result goes to its slot
+                auto temp = info.value(a);
                 info.cc.mov(x86::qword_ptr(info.arg1), temp);
                 info.cc.ret(temp);
             }
@@ -143,17 +484,13 @@ jit::CompilationResult jit::JitRuntime::compile(interpreter::VMData &vm,
             }
                 break;
             case OP_MOVE: {
-                auto temp = info.cc.newUInt64();
-                info.cc.mov(temp, x86::ptr(info.arg1, b * 8));
-                info.cc.mov(x86::ptr(info.arg1, a * 8), temp);
+                info.set_value(a, info.value(b));
             }
                 break;
             case OP_LOADNIL: {
                 Value v;
                 v.set_nil();
-                auto temp = info.cc.newUInt64();
-                info.cc.movabs(temp, v.as_uint64());
-                info.cc.mov(x86::qword_ptr(info.arg1, a * 8), temp);
+                info.set_const(a, v.as_uint64());
                 break;
             }
             case OP_MOD: {
@@ -164,64 +501,96 @@ jit::CompilationResult jit::JitRuntime::compile(interpreter::VMData &vm,
                 info.neg(a, b);
             }
                 break;
-            case OP_EQ: {
-                auto t1 = info.cc.newUInt64();
-                auto t2 = info.cc.newUInt64();
-                info.cc.mov(t1, x86::qword_ptr(info.arg1, b * 8));
-                info.cc.mov(t2, x86::qword_ptr(info.arg1, c * 8));
-                info.cc.bts(t1, 33);
-                info.cc.bts(t2, 33);
-                info.cc.cmp(t1, t2);
-                auto dummy = info.cc.newInt8();
-                auto dummy2 = info.cc.newInt32();
-                info.cc.sete(dummy);
-                info.cc.movzx(dummy2, dummy);
-                info.cc.mov(x86::dword_ptr(info.arg1, a * 8), dummy2);
-                info.cc.mov(x86::dword_ptr(info.arg1, a * 8 + 4), TYPE_INT);
-            }
-                break;
+            case OP_EQ:
             case OP_NEQ: {
-                auto t1 = info.cc.newUInt64();
-                auto t2 = info.cc.newUInt64();
-                info.cc.mov(t1, x86::qword_ptr(info.arg1, b * 8));
-                info.cc.mov(t2, x86::qword_ptr(info.arg1, c * 8));
-                info.cc.bts(t1, 33);
-                info.cc.bts(t2, 33);
-                info.cc.cmp(t1, t2);
+                info.cc.emit(x86::Inst::kIdCmp, info.value(b), info.whole(c));
                 auto dummy = info.cc.newInt8();
                 auto dummy2 = info.cc.newInt32();
-                info.cc.setne(dummy);
+                if (op == OP_EQ) info.cc.sete(dummy);
+                else info.cc.setne(dummy);
                 info.cc.movzx(dummy2, dummy);
-                info.cc.mov(x86::dword_ptr(info.arg1, a * 8), dummy2);
-                info.cc.mov(x86::dword_ptr(info.arg1, a * 8 + 4), TYPE_INT);
+                info.set_typed(a, TYPE_INT, dummy2);
             }
                 break;
             case OP_JMP: {
+                backedge(i + 1 + sbx);
                 info.cc.jmp(labels[i + 1 + sbx]);
                 break;
             }
             case OP_JMPT: {
-                info.cjmp<true>(a, labels[1 + i + sbx]);
+                backedge(1 + i + sbx);
+                info.truth_jump(true, a, labels[1 + i + sbx]);
+                break;
+            }
+            case OP_ADDI:
+            case OP_SUBI:
+            case OP_MULI: {
+                static constexpr OpCode base[] = {OP_ADD, OP_SUB, OP_MUL};
+                Value k;
+                k.set_int(static_cast<int32_t>(c) - static_cast<int32_t>(IMM_ZERO));
+                info.const_operation(base[(instr >> OPCODE_SHIFT) - OP_ADDI], a, b, k);
+                break;
+            }
+            case OP_ADDK:
+            case OP_SUBK:
+            case OP_MULK:
+            case OP_DIVK:
+            case OP_MODK: {
+                static constexpr OpCode base[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD};
+                info.const_operation(base[(instr >> OPCODE_SHIFT) - OP_ADDK], a, b, vm.constantk[c]);
+                break;
+            }
+            case OP_EQI:
+            case OP_LTI:
+            case OP_LEI:
+            case OP_GTI:
+            case OP_GEI: {
+                backedge(i + 2 + jump_offset(vm.code[start]));
+                const uint32_t jmp = vm.code[start++];
+                const int target = i + 2 + jump_offset(jmp);
+                info.cmp_imm_jump(static_cast<OpCode>(instr >> OPCODE_SHIFT), a != 0, b,
+                                  static_cast<int32_t>(c) - static_cast<int32_t>(IMM_ZERO), labels[target]);
+                i++;
+                break;
+            }
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JNLT:
+            case OP_JNLE: {
+                // the following OP_JMP only holds the target, so it is consumed here
+                backedge(i + 2 + jump_offset(vm.code[start]));
+                const uint32_t jmp = vm.code[start++];
+                const int target = i + 2 + jump_offset(jmp);
+                info.cmp_jump(op, b, c, labels[target], expect);
+                i++;
                 break;
             }
             case OP_INVOKEDYNAMIC:
+                // the guard of the cache makes a guessed callee safe
+                info.invoke(call_site(loaded_func(a, start - 2), c), a, b, c, start);
+                break;
+            case OP_TAILCALL: {
+                // only self tail calls are compiled, as a jump to the entry
+                if (loaded_func(a, start - 2) != self || c != func.arity)
+                    throw std::runtime_error("cannot compile");
+                // the jump to the entry closes a loop too
+                info.gc_poll(start - 1);
+                info.self_tail_call(self, a, b, c, entry);
                 break;
+            }
             case OP_HALT:
                 throw std::runtime_error("cannot compile");
                 break;
             case OP_LOADFUNC: {
-                throw std::runtime_error("not supported");
-//                Value v;
-//                v.set_callable(bx);
-//                auto temp = info.cc.newUInt64();
-//                info.cc.movabs(temp, v.as_uint64());
-//                info.cc.movabs(x86::ptr(info.arg1, a * 8), temp);
-//                break;
+                Value v;
+                v.set_callable(static_cast<int>(bx));
+                info.set_const(a, v.as_uint64());
+                break;
             }
             case OP_LOADFLOAT: {
-                auto temp = info.cc.newUInt64();
-                info.cc.movabs(temp, vm.constantf[bx].as_uint64());
-                info.cc.mov(x86::ptr(info.arg1, a * 8), temp);
+                info.set_const(a, vm.constantf[bx].as_uint64());
                 break;
             }
             case OP_ALLOC: {
@@ -229,18 +598,19 @@ jit::CompilationResult jit::JitRuntime::compile(interpreter::VMData &vm,
                 break;
             }
             case OP_ARRGET: {
-                info.op_arrget(a, b, c);
+                info.op_arrget(a, b, c, start);
                 break;
             }
             case OP_ARRSET: {
-                info.op_arrset(a, b, c);
+                info.op_arrset(a, b, c, start);
                 break;
             }
             default:
                 throw std::runtime_error("not supported");
         }
-
+        step_types(vm, info.types, op, a, b, c, bx, expect);
     }
+    info.emit_exits();
     info.cc.endFunc();
     info.cc.finalize();
 
@@ -261,166 +631,629 @@ jit::FuncCompiled jit::JitRuntime::compile_safe(interpreter::VMData &vm, interpr
 }
 
 
-void jit::JitFuncInfo::modulo_operation(int a, int b, int c) {
-    using namespace interpreter;
+asmjit::x86::Gp jit::JitFuncInfo::value(int r) {
+    if (is_promoted(r)) return promoted[r];
+    auto temp = cc.newUInt64();
+    cc.mov(temp, asmjit::x86::qword_ptr(arg1, r * 8));
+    return temp;
+}
+
+asmjit::Operand jit::JitFuncInfo::whole(int r) {
+    if (is_promoted(r)) return promoted[r];
+    return asmjit::x86::qword_ptr(arg1, r * 8);
+}
+
+asmjit::Operand jit::JitFuncInfo::payload(int r) {
+    if (is_promoted(r)) return promoted[r].r32();
+    return slot(r);
+}
+
+asmjit::x86::Vec jit::JitFuncInfo::load_float(int r) {
+    auto xmm = cc.newXmmSs();
+    if (is_promoted(r)) cc.movd(xmm, promoted[r].r32());
+    else cc.movss(xmm, slot(r));
+    return xmm;
+}
+
+void jit::JitFuncInfo::cmp_type(int r, uint32_t type) {
+    if (!is_promoted(r)) {
+        cc.cmp(slot(r, 4), type);
+        return;
+    }
+    auto temp = cc.newUInt64();
+    cc.mov(temp, promoted[r]);
+    cc.shr(temp, 32);
+    cc.cmp(temp.r32(), type);
+}
+
+void jit::JitFuncInfo::guard(int r, uint32_t type, const asmjit::Label &miss) {
+    const uint32_t t = known(r);
+    if (t == type) return;
+    if (t != TYPE_UNKNOWN) {
+        cc.jmp(miss);
+        return;
+    }
+    cmp_type(r, type);
+    cc.jne(miss);
+}
+
+asmjit::Label jit::JitFuncInfo::fail() {
+    if (exits.empty() || exits.back().first != ip) exits.emplace_back(ip, cc.newLabel());
+    return exits.back().second;
+}
+
+asmjit::Label jit::JitFuncInfo::leave() {
+    if (!left.isValid()) left = cc.newLabel();
+    return left;
+}
+
+void jit::JitFuncInfo::emit_exits() {
     using namespace asmjit;
-    auto err = cc.newLabel();
-    auto nxt = cc.newLabel();
+    if (left.isValid()) {
+        cc.bind(left);
+        auto code = cc.newUInt64();
+        cc.movabs(code, ERR_LEAVE);
+        cc.ret(code);
+    }
+    auto common = cc.newLabel();
+    auto ptr = cc.newUIntPtr();
+    for (auto &[at, label]: exits) {
+        cc.bind(label);
+        cc.mov(ptr, &vm.ip);
+        cc.mov(x86::dword_ptr(ptr), at);
+        cc.jmp(common);
+    }
+    cc.bind(common);
+    spill_all();
+    auto code = cc.newUInt64();
+    cc.movabs(code, ERR_TYPE);
+    cc.ret(code);
+}
 
-    auto temp2 = cc.newUInt64();
-    auto temp3 = cc.newUInt64();
+void jit::JitFuncInfo::set_value(int r, const asmjit::x86::Gp &v) {
+    if (is_promoted(r)) {
+        if (promoted[r].id() != v.id()) cc.mov(promoted[r], v);
+        return;
+    }
+    cc.mov(asmjit::x86::qword_ptr(arg1, r * 8), v);
+}
 
+void jit::JitFuncInfo::set_const(int r, uint64_t bits) {
+    if (is_promoted(r)) {
+        cc.movabs(promoted[r], bits);
+        return;
+    }
+    auto temp = cc.newUInt64();
+    cc.movabs(temp, bits);
+    cc.mov(asmjit::x86::qword_ptr(arg1, r * 8), temp);
+}
+
+void jit::JitFuncInfo::set_typed(int r, uint32_t type, const asmjit::x86::Gp &payload) {
+    if (!is_promoted(r)) {
+        cc.mov(slot(r), payload);
+        cc.mov(slot(r, 4), type);
+        return;
+    }
+    // a 32-bit move clears the high half, the type bits go on top
+    cc.mov(promoted[r].r32(), payload);
+    auto tag = cc.newUInt64();
+    cc.movabs(tag, static_cast<uint64_t>(type) << 32);
+    cc.or_(promoted[r], tag);
+}
+
+void jit::JitFuncInfo::set_float(int r, const asmjit::x86::Vec &x) {
+    if (!is_promoted(r)) {
+        cc.movd(slot(r), x);
+        cc.mov(slot(r, 4), interpreter::TYPE_FLOAT);
+        return;
+    }
+    auto bits = cc.newInt32();
+    cc.movd(bits, x);
+    set_typed(r, interpreter::TYPE_FLOAT, bits);
+}
+
+void jit::JitFuncInfo::spill(int r) {
+    if (is_promoted(r)) cc.mov(asmjit::x86::qword_ptr(arg1, r * 8), promoted[r]);
+}
+
+void jit::JitFuncInfo::reload(int r) {
+    if (is_promoted(r)) cc.mov(promoted[r], asmjit::x86::qword_ptr(arg1, r * 8));
+}
+
+void jit::JitFuncInfo::spill_all() {
+    for (int r = 0; r < static_cast<int>(promoted.size()); r++) spill(r);
+}
+
+void jit::JitFuncInfo::reload_all() {
+    for (int r = 0; r < static_cast<int>(promoted.size()); r++) reload(r);
+}
+
+void jit::JitFuncInfo::modulo_operation(int a, int b, int c) {
+    using namespace interpreter;
+    using namespace asmjit;
     {//int * int
-        cc.cmp(x86::dword_ptr(arg1, b * 8 + 4), TYPE_INT);
-        cc.jne(err);
-        cc.cmp(x86::dword_ptr(arg1, c * 8 + 4), TYPE_INT);
-        cc.jne(err);
+        guard(b, TYPE_INT, fail());
+        guard(c, TYPE_INT, fail());
         auto temp = cc.newInt32();
-        cc.mov(temp, x86::dword_ptr(arg1, b * 8));
-        interpreter::Value tempInt;
-        tempInt.set_int(0);
+        cc.emit(x86::Inst::kIdMov, temp, payload(b));
         {
-            cc.cmp(x86::dword_ptr(arg1, c * 8), 0);
-            cc.je(err);
+            cc.emit(x86::Inst::kIdCmp, payload(c), 0);
+            cc.je(fail());
             x86::Gp dummy2 = cc.newInt32();
             cc.cdq(dummy2, temp);
-            cc.idiv(dummy2, temp, x86::dword_ptr(arg1, c * 8));
+            cc.emit(x86::Inst::kIdIdiv, dummy2, temp, payload(c));
             cc.mov(temp, dummy2);
         }
-        cc.mov(x86::dword_ptr(arg1, a * 8), temp);
-        cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-        cc.mov(temp2, x86::qword_ptr(arg1, a * 8));
-        cc.jmp(nxt);
+        set_typed(a, TYPE_INT, temp);
     }
-    cc.bind(err);
-    auto failCode = cc.newUInt64();
-    cc.movabs(failCode, OBJ_NIL);
-    cc.add(failCode, 1);
-    cc.ret(failCode);
-    cc.bind(nxt);
-
-//    cc.movabs(temp2, 18446744069414584320ull);
-//    cc.and_(stack[a], temp2);
 }
 
 void jit::JitFuncInfo::neg(int a, int b) {
     using namespace asmjit;
     using namespace interpreter;
-    auto err = cc.newLabel();
     auto sf = cc.newLabel();
     auto nxt = cc.newLabel();
-    {
-        cc.cmp(x86::dword_ptr(arg1, b * 8 + 4), TYPE_INT);
-        cc.jne(sf);
+    if (known(b) != TYPE_FLOAT) {
+        guard(b, TYPE_INT, sf);
         auto temp = cc.newInt32();
-        cc.mov(temp, x86::dword_ptr(arg1, b * 8));
+        cc.emit(x86::Inst::kIdMov, temp, payload(b));
         cc.neg(temp);
-        cc.mov(x86::dword_ptr(arg1, a * 8), temp);
-        cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
+        set_typed(a, TYPE_INT, temp);
+        if (known(b) == TYPE_INT) return;
         cc.jmp(nxt);
     }
     {
         cc.bind(sf);
-        cc.cmp(x86::dword_ptr(arg1, b * 8 + 4), TYPE_FLOAT);
-        cc.jne(err);
+        guard(b, TYPE_FLOAT, fail());
         auto xmm = cc.newXmmSs();
         cc.xorps(xmm, xmm);
-        cc.subss(xmm, x86::dword_ptr(arg1, b * 8));
-        cc.movd(x86::qword_ptr(arg1, a * 8), xmm);
-        cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_FLOAT);
+        cc.subss(xmm, load_float(b));
+        set_float(a, xmm);
+    }
+    cc.bind(nxt);
+}
+
+void jit::JitFuncInfo::truth_jump(bool jmpT, int a, const asmjit::Label &label) {
+    using namespace asmjit;
+    using namespace interpreter;
+    auto sf = cc.newLabel();
+    auto obj = cc.newLabel();
+    auto nxt = cc.newLabel();
+    auto jump_if = [&](bool equal) {
+        if (jmpT != equal) cc.jne(label);
+        else cc.je(label);
+    };
+    // -0.0f is false too, so the sign bit is shifted out before the zero test
+    auto float_jump = [&] {
+        auto bits = cc.newUInt32();
+        cc.emit(x86::Inst::kIdMov, bits, payload(a));
+        cc.add(bits, bits);
+        jump_if(false);
+    };
+    const uint32_t t = known(a);
+    if (t == TYPE_INT) {
+        cc.emit(x86::Inst::kIdCmp, payload(a), 0);
+        jump_if(false);
+        return;
+    }
+    if (t == TYPE_FLOAT) {
+        float_jump();
+        return;
+    }
+    if (t != TYPE_UNKNOWN) {
+        if (jmpT == (t != TYPE_NIL)) cc.jmp(label);
+        return;
+    }
+    {
+        cmp_type(a, TYPE_INT);
+        cc.jne(sf);
+        cc.emit(x86::Inst::kIdCmp, payload(a), 0);
+        jump_if(false);
+        cc.jmp(nxt);
+    }
+    {
+        cc.bind(sf);
+        cmp_type(a, TYPE_FLOAT);
+        cc.jne(obj);
+        float_jump();
         cc.jmp(nxt);
     }
-    cc.bind(err);
-    auto failCode = cc.newUInt64();
-    cc.movabs(failCode, OBJ_NIL);
-    cc.add(failCode, 1);
-    cc.ret(failCode);
+    {
+        // anything else is true but nil
+        cc.bind(obj);
+        cmp_type(a, TYPE_NIL);
+        jump_if(false);
+    }
     cc.bind(nxt);
 }
 
-namespace {
+void jit::JitFuncInfo::cmp_jump(interpreter::OpCode op, int b, int c, const asmjit::Label &label,
+                                uint32_t expect) {
+    using namespace asmjit;
+    using namespace interpreter;
+    if (op == OP_JEQ || op == OP_JNE) {
+        cc.emit(x86::Inst::kIdCmp, value(b), whole(c));
+        if (op == OP_JEQ) cc.je(label);
+        else cc.jne(label);
+        return;
+    }
+    const uint32_t type = speculated_type(known(b), known(c), expect);
+    if (type != TYPE_UNKNOWN) {
+        compare_branch(op, b, c, type, label, fail());
+        return;
+    }
+    auto sf = cc.newLabel();
+    auto nxt = cc.newLabel();
+    compare_branch(op, b, c, TYPE_INT, label, sf);
+    cc.jmp(nxt);
+    cc.bind(sf);
+    compare_branch(op, b, c, TYPE_FLOAT, label, fail());
+    cc.bind(nxt);
+}
 
+void jit::JitFuncInfo::compare_branch(interpreter::OpCode op, int b, int c, uint32_t type,
+                                      const asmjit::Label &label, const asmjit::Label &miss) {
+    using namespace asmjit;
+    using namespace interpreter;
+    guard(b, type, miss);
+    guard(c, type, miss);
+    if (type == TYPE_INT) {//int < int
+        auto temp = cc.newInt32();
+        cc.emit(x86::Inst::kIdMov, temp, payload(b));
+        cc.emit(x86::Inst::kIdCmp, temp, payload(c));
+        if (op == OP_JLT) cc.jl(label);
+        else if (op == OP_JLE) cc.jle(label);
+        else if (op == OP_JNLT) cc.jge(label);
+        else cc.jg(label);
+        return;
+    }
+    //float < float, compared as c > b so that NaN makes the comparison false
+    auto temp = load_float(c);
+    cc.comiss(temp, load_float(b));
+    if (op == OP_JLT) cc.ja(label);
+    else if (op == OP_JLE) cc.jae(label);
+    else if (op == OP_JNLT) cc.jbe(label);
+    else cc.jb(label);
+}
 
-    asmjit::x86::Gp getArg1() {
-#if defined(_WIN32)
-        return asmjit::x86::rcx;
-#else
-        return asmjit::x86::rdi;
-#endif
+void jit::JitFuncInfo::const_operation(interpreter::OpCode op, int a, int b, const interpreter::Value &k) {
+    using namespace asmjit;
+    using namespace interpreter;
+    if (k.is_int()) {
+        guard(b, TYPE_INT, fail());
+        auto temp = cc.newInt32();
+        cc.emit(x86::Inst::kIdMov, temp, payload(b));
+        if (op == OP_ADD) {
+            cc.add(temp, k.i32);
+        } else if (op == OP_SUB) {
+            cc.sub(temp, k.i32);
+        } else if (op == OP_MUL) {
+            cc.imul(temp, temp, k.i32);
+        } else if (k.i32 == 0) {
+            cc.jmp(fail());
+        } else {
+            auto divisor = cc.newInt32();
+            auto rem = cc.newInt32();
+            cc.mov(divisor, k.i32);
+            cc.cdq(rem, temp);
+            cc.idiv(rem, temp, divisor);
+            if (op == OP_MOD) cc.mov(temp, rem);
+        }
+        set_typed(a, TYPE_INT, temp);
+    } else {
+        guard(b, TYPE_FLOAT, fail());
+        if (op == OP_MOD) {
+            cc.jmp(fail());
+        } else {
+            auto temp = load_float(b);
+            auto kreg = cc.newXmmSs();
+            auto bits = cc.newInt32();
+            cc.mov(bits, k.i32);
+            cc.movd(kreg, bits);
+            if (op == OP_ADD) cc.addss(temp, kreg);
+            else if (op == OP_SUB) cc.subss(temp, kreg);
+            else if (op == OP_MUL) cc.mulss(temp, kreg);
+            else cc.divss(temp, kreg);
+            set_float(a, temp);
+        }
     }
+}
 
-    asmjit::x86::Gp getArg2() {
-#if defined(_WIN32)
-        return asmjit::x86::rdx;
-#else
-        return asmjit::x86::rsi;
-#endif
+void jit::JitFuncInfo::self_tail_call(int self, int a, int b, int c, const asmjit::Label &entry) {
+    using namespace asmjit;
+    using namespace interpreter;
+    Value callee;
+    callee.set_callable(self);
+    auto expected = cc.newUInt64();
+    cc.movabs(expected, callee.as_uint64());
+    cc.emit(x86::Inst::kIdCmp, expected, whole(a));
+    cc.jne(fail());
+    for (int i = 0; i < c; i++) {
+        set_value(i, value(b + i));
     }
+    cc.jmp(entry);
+}
 
-    asmjit::x86::Gp getArg3() {
-#if defined(_WIN32)
-        return asmjit::x86::r8;
-#else
-        return asmjit::x86::rdx;
-#endif
+void jit::JitFuncInfo::cmp_imm_jump(interpreter::OpCode op, bool negate, int b, int32_t imm,
+                                    const asmjit::Label &label) {
+    using namespace asmjit;
+    using namespace interpreter;
+    auto not_int = cc.newLabel();
+    auto nxt = cc.newLabel();
+    guard(b, TYPE_INT, not_int);
+    cc.emit(x86::Inst::kIdCmp, payload(b), imm);
+    switch (op) {
+        case OP_EQI:
+            if (negate) cc.jne(label);
+            else cc.je(label);
+            break;
+        case OP_LTI:
+            if (negate) cc.jge(label);
+            else cc.jl(label);
+            break;
+        case OP_LEI:
+            if (negate) cc.jg(label);
+            else cc.jle(label);
+            break;
+        case OP_GTI:
+            if (negate) cc.jle(label);
+            else cc.jg(label);
+            break;
+        default:
+            if (negate) cc.jl(label);
+            else cc.jge(label);
     }
+    cc.jmp(nxt);
+    cc.bind(not_int);
+    if (op == OP_EQI) {
+        // a non-int is never equal to an int
+        if (negate) cc.jmp(label);
+    } else {
+        cc.jmp(fail());
+    }
+    cc.bind(nxt);
+}
 
-    asmjit::x86::Gp getArg4() {
-#if defined(_WIN32)
-        return asmjit::x86::r9;
-#else
-        return asmjit::x86::rcx;
-#endif
+namespace {
+    void poll_gc(interpreter::VMData &vm, int, int) {
+        vm.gc.poll();
     }
 }
 
 void jit::JitFuncInfo::native_call3(void *func, int b, int c) {
     using namespace asmjit;
-    cc.push(getArg1());
-    cc.push(getArg2());
-    cc.push(getArg3());
-    cc.push(x86::rax);//save registers
-    cc.sub(x86::rsp, 32);//move rsp
-    cc.mov(getArg1(), &vm);//set up args...
-    cc.mov(getArg2(), b);
-    cc.mov(getArg3(), c);
-    cc.mov(x86::rax, func);
-    cc.call(x86::rax);//call
-    cc.add(x86::rsp, 32);//mov back rsp
-    cc.pop(x86::rax);//restore registers
-    cc.pop(getArg3());
-    cc.pop(getArg2());
-    cc.pop(getArg1());
-}
-
-void jit::JitFuncInfo::native_call4(void *func, int a, int b, int c) {
+    // the native reads its arguments from the slots, writes its result there and may move objects
+    spill_all();
+    InvokeNode *call;
+    auto threw = cc.newUInt8();
+    cc.invoke(&call, reinterpret_cast<uint64_t>(&interpreter::native_from_jit),
+              FuncSignature::build<bool, void *, void *, int, int>());
+    call->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    call->setArg(1, Imm(reinterpret_cast<uint64_t>(func)));
+    call->setArg(2, Imm(b));
+    call->setArg(3, Imm(c));
+    call->setRet(0, threw);
+    cc.test(threw, threw);
+    cc.jnz(leave());
+    reload_all();
+}
+
+void jit::JitFuncInfo::gc_poll(uint32_t ip) {
     using namespace asmjit;
-    cc.push(getArg1());
-    cc.push(getArg2());
-    cc.push(getArg3());
-    cc.push(getArg4());
-    cc.push(x86::rax);//save registers
-    cc.sub(x86::rsp, 32);//move rsp
-    cc.mov(getArg1(), &vm);//set up args...
-    cc.mov(getArg2(), a);
-    cc.mov(getArg3(), b);
-    cc.mov(getArg4(), c);
-    cc.mov(x86::rax, func);
-    cc.call(x86::rax);//call
-    cc.add(x86::rsp, 32);//mov back rsp
-    cc.pop(x86::rax);//restore registers
-    cc.pop(getArg4());
-    cc.pop(getArg3());
-    cc.pop(getArg2());
-    cc.pop(getArg1());
+    auto skip = cc.newLabel();
+    auto ptr = cc.newUIntPtr();
+    cc.mov(ptr, &vm.gc.poll_pending);
+    cc.cmp(x86::byte_ptr(ptr), 0);
+    cc.je(skip);
+    cc.mov(ptr, &vm.ip);
+    cc.mov(x86::dword_ptr(ptr), ip);
+    native_call3((void *) poll_gc, 0, 0);
+    cc.bind(skip);
 }
 
-void jit::JitFuncInfo::op_arrget(int a, int b, int c) {
-    native_call4((void *) interpreter::op_arrget, a, b, c);
+void jit::JitFuncInfo::direct_call(const CallCache &cache, int b, uint32_t return_ip, const asmjit::Label &slow,
+                                   const asmjit::Label &done) {
+    using namespace asmjit;
+    using namespace interpreter;
+    auto deopt = cc.newLabel();
+    auto site = cc.newUIntPtr();
+    cc.mov(site, &cache);
+    // the callee's code is read on every call, it may get compiled or dropped later
+    auto code = cc.newUIntPtr();
+    cc.mov(code, x86::qword_ptr(site, offsetof(CallCache, code)));
+    cc.mov(code, x86::qword_ptr(code));
+    cc.test(code, code);
+    cc.jz(slow);
+    auto frame = cc.newUIntPtr();
+    cc.lea(frame, x86::ptr(arg1, b * 8));
+    cc.cmp(frame, x86::qword_ptr(site, offsetof(CallCache, bound)));
+    cc.ja(slow);
+    auto ptr = cc.newUIntPtr();
+    auto limit = cc.newUIntPtr();
+    auto next = cc.newUIntPtr();
+    cc.mov(ptr, vm.call_stack.limit_slot());
+    cc.mov(limit, x86::qword_ptr(ptr));
+    cc.mov(ptr, vm.call_stack.next_slot());
+    cc.mov(next, x86::qword_ptr(ptr));
+    cc.cmp(next, limit);
+    cc.jae(slow);
+    // each direct call nests on the native stack, past the limit call_from_jit leaves to the interpreter
+    auto depth = cc.newUIntPtr();
+    cc.mov(depth, &vm.native_depth);
+    cc.cmp(x86::dword_ptr(depth), NATIVE_DEPTH_LIMIT);
+    cc.jae(slow);
+    // CallFrame{return_ip, vm.fp, callee}, then the callee's fp
+    auto fp_ptr = cc.newUIntPtr();
+    auto fp = cc.newUInt32();
+    cc.mov(fp_ptr, &vm.fp);
+    cc.mov(fp, x86::dword_ptr(fp_ptr));
+    cc.mov(x86::dword_ptr(next, offsetof(CallFrame, return_ip)), return_ip);
+    cc.mov(x86::dword_ptr(next, offsetof(CallFrame, base_ptr)), fp);
+    auto func = cc.newUIntPtr();
+    cc.mov(func, x86::qword_ptr(site, offsetof(CallCache, func)));
+    cc.mov(x86::qword_ptr(next, offsetof(CallFrame, cur_func)), func);
+    cc.add(next, sizeof(CallFrame));
+    cc.mov(x86::qword_ptr(ptr), next);
+    cc.add(fp, b);
+    cc.mov(x86::dword_ptr(fp_ptr), fp);
+
+    cc.inc(x86::dword_ptr(depth));
+
+    InvokeNode *invoke;
+    auto ret = cc.newUInt64();
+    cc.invoke(&invoke, code, FuncSignature::build<uint64_t, void *>());
+    invoke->setArg(0, frame);
+    invoke->setRet(0, ret);
+    cc.mov(depth, &vm.native_depth);
+    cc.dec(x86::dword_ptr(depth));
+    auto err = cc.newUInt64();
+    cc.movabs(err, ERR_TYPE);
+    cc.cmp(ret, err);
+    cc.je(deopt);
+    // the callee left a call to the interpreter, so do we: the frames above ours stay as they are
+    cc.movabs(err, ERR_LEAVE);
+    cc.cmp(ret, err);
+    cc.je(leave());
+    // the result is in the callee's slot 0, our slot b
+    cc.mov(ptr, vm.call_stack.next_slot());
+    cc.sub(x86::qword_ptr(ptr), sizeof(CallFrame));
+    cc.mov(ptr, &vm.fp);
+    cc.sub(x86::dword_ptr(ptr), b);
+    cc.jmp(done);
+
+    cc.bind(deopt);
+    auto leaves = cc.newUInt8();
+    cc.invoke(&invoke, reinterpret_cast<uint64_t>(&interpreter::resume_deopted),
+              FuncSignature::build<bool, void *>());
+    invoke->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    invoke->setRet(0, leaves);
+    cc.test(leaves, leaves);
+    cc.jnz(leave());
+    cc.jmp(done);
 }
 
-void jit::JitFuncInfo::op_arrset(int a, int b, int c) {
-    native_call4((void *) interpreter::op_arrset, a, b, c);
+void jit::JitFuncInfo::call(const CallCache &cache, uint32_t idx, int b, int c, uint32_t return_ip) {
+    using namespace asmjit;
+    auto slow = cc.newLabel();
+    auto done = cc.newLabel();
+    // the callee reads its arguments from the slots and may collect
+    spill_all();
+    if (cache.callable != 0) direct_call(cache, b, return_ip, slow, done);
+    cc.bind(slow);
+    InvokeNode *invoke;
+    auto leaves = cc.newUInt8();
+    cc.invoke(&invoke, reinterpret_cast<uint64_t>(&interpreter::call_from_jit),
+              FuncSignature::build<bool, void *, uint32_t, uint32_t, uint32_t, uint32_t>());
+    invoke->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    invoke->setArg(1, Imm(idx));
+    invoke->setArg(2, Imm(b));
+    invoke->setArg(3, Imm(c));
+    invoke->setArg(4, Imm(return_ip));
+    invoke->setRet(0, leaves);
+    cc.test(leaves, leaves);
+    cc.jnz(leave());
+    cc.bind(done);
+    reload_all();
+}
+
+void jit::JitFuncInfo::invoke(const CallCache &cache, int a, int b, int c, uint32_t return_ip) {
+    using namespace asmjit;
+    auto slow = cc.newLabel();
+    auto done = cc.newLabel();
+    spill_all();
+    auto cached = cc.newUInt64();
+    auto site = cc.newUIntPtr();
+    cc.mov(site, &cache);
+    cc.mov(cached, x86::qword_ptr(site, offsetof(CallCache, callable)));
+    cc.emit(x86::Inst::kIdCmp, cached, whole(a));
+    cc.jne(slow);
+    direct_call(cache, b, return_ip, slow, done);
+    cc.bind(slow);
+    InvokeNode *invoke;
+    auto leaves = cc.newUInt8();
+    cc.invoke(&invoke, reinterpret_cast<uint64_t>(&interpreter::invoke_from_jit),
+              FuncSignature::build<bool, void *, void *, uint32_t, uint32_t, uint32_t, uint32_t>());
+    invoke->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    invoke->setArg(1, Imm(reinterpret_cast<uint64_t>(&cache)));
+    invoke->setArg(2, Imm(a));
+    invoke->setArg(3, Imm(b));
+    invoke->setArg(4, Imm(c));
+    invoke->setArg(5, Imm(return_ip));
+    invoke->setRet(0, leaves);
+    cc.test(leaves, leaves);
+    cc.jnz(leave());
+    cc.bind(done);
+    reload_all();
 }
 
+void jit::JitFuncInfo::op_arrget(int a, int b, int c, uint32_t ip) {
+    using namespace asmjit;
+    using namespace interpreter;
+    // the fast path reads the element in place, interpreter::op_arrget throws for the rest and leave() rethrows
+    auto slow = cc.newLabel();
+    auto nxt = cc.newLabel();
+    guard(c, TYPE_INT, slow);
+    auto arr = value(b);
+    auto tag = cc.newUInt64();
+    cc.mov(tag, arr);
+    cc.shr(tag, 32);
+    cc.test(tag.r32(), TYPE_OBJ);
+    cc.jz(slow);
+    // the array length is in type_part above the object bit
+    cc.shr(tag.r32(), 2);
+    auto idx = cc.newUInt64();
+    cc.emit(x86::Inst::kIdMov, idx.r32(), payload(c));
+    cc.cmp(idx.r32(), tag.r32());
+    cc.jae(slow);
+    auto addr = cc.newUInt64();
+    cc.mov(addr.r32(), arr.r32());
+    cc.add(addr, idx);
+    auto base = cc.newUIntPtr();
+    cc.mov(base, vm.gc.cage.at(0));
+    auto element = cc.newUInt64();
+    cc.mov(element, x86::qword_ptr(base, addr, 3, sizeof(Value)));
+    set_value(a, element);
+    cc.jmp(nxt);
+
+    cc.bind(slow);
+    spill(b);
+    spill(c);
+    auto ptr = cc.newUIntPtr();
+    cc.mov(ptr, &vm.ip);
+    cc.mov(x86::dword_ptr(ptr), ip);
+    InvokeNode *call;
+    auto threw = cc.newUInt8();
+    cc.invoke(&call, reinterpret_cast<uint64_t>(&interpreter::arrget_from_jit),
+              FuncSignature::build<bool, void *, uint32_t, uint32_t, uint32_t>());
+    call->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    call->setArg(1, Imm(a));
+    call->setArg(2, Imm(b));
+    call->setArg(3, Imm(c));
+    call->setRet(0, threw);
+    cc.test(threw, threw);
+    cc.jnz(leave());
+    reload(a);
+    cc.bind(nxt);
+}
 
+void jit::JitFuncInfo::op_arrset(int a, int b, int c, uint32_t ip) {
+    using namespace asmjit;
+    // the store goes through the write barrier, it does not collect and writes no register
+    spill(a);
+    spill(b);
+    spill(c);
+    auto ptr = cc.newUIntPtr();
+    cc.mov(ptr, &vm.ip);
+    cc.mov(x86::dword_ptr(ptr), ip);
+    InvokeNode *call;
+    auto threw = cc.newUInt8();
+    cc.invoke(&call, reinterpret_cast<uint64_t>(&interpreter::arrset_from_jit),
+              FuncSignature::build<bool, void *, uint32_t, uint32_t, uint32_t>());
+    call->setArg(0, Imm(reinterpret_cast<uint64_t>(&vm)));
+    call->setArg(1, Imm(a));
+    call->setArg(2, Imm(b));
+    call->setArg(3, Imm(c));
+    call->setRet(0, threw);
+    cc.test(threw, threw);
+    cc.jnz(leave());
+}
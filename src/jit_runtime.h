@@ -14,6 +14,7 @@
 #include "vm.h"
 #include "misc.h"
 #include <cstring>
+#include <deque>
 /*
 Live statement:
 1. stores into mem, performs I/O,
@@ -40,7 +41,52 @@ namespace jit {
     using FuncCompiled = uint64_t (*)(void *);
 
     static constexpr uint64_t HIGH32 = 18446744069414584320ull;
+    // returned by jitted code that deopted, no value of the language has these bits
     static constexpr uint64_t ERR_TYPE = interpreter::OBJ_NIL + 1;
+    // returned by jitted code that left a call to the interpreter, see interpreter::call_from_jit. The frames
+    // are in their slots and the dispatch loop goes on with the innermost one at vm.ip
+    static constexpr uint64_t ERR_LEAVE = interpreter::OBJ_NIL + 2;
+    // no single type_part, TYPE_OBJ carries the length
+    static constexpr uint32_t TYPE_UNKNOWN = 0;
+
+    // The type both operands of an arithmetic instruction have when it does not deopt: the known one,
+    // TYPE_UNKNOWN if it may be either
+    inline uint32_t operand_type(uint32_t x, uint32_t y) {
+        const bool numeric_x = x == interpreter::TYPE_INT || x == interpreter::TYPE_FLOAT;
+        const bool numeric_y = y == interpreter::TYPE_INT || y == interpreter::TYPE_FLOAT;
+        if (numeric_x && (y == x || y == TYPE_UNKNOWN)) return x;
+        if (numeric_y && x == TYPE_UNKNOWN) return y;
+        return TYPE_UNKNOWN;
+    }
+
+    // operand_type, the profiled type expect for operands of unknown types
+    inline uint32_t speculated_type(uint32_t x, uint32_t y, uint32_t expect) {
+        const uint32_t type = operand_type(x, y);
+        return type != TYPE_UNKNOWN || x != TYPE_UNKNOWN || y != TYPE_UNKNOWN ? type : expect;
+    }
+
+    // A call site of jitted code and the callee it calls directly, set when the site is compiled or by its
+    // first call. The code reads it on every call
+    struct CallCache {
+        // Value of the callee, 0 while there is none
+        uint64_t callable = 0;
+        interpreter::Function *func = nullptr;
+        // &func->jitted, the callee may get compiled or dropped after the site
+        interpreter::mFuncCompiled *code = nullptr;
+        // the highest frame the callee's registers fit at
+        interpreter::Value *bound = nullptr;
+
+        // functions[idx] has max_stack <= the stack capacity
+        void fill(interpreter::VMData &vm, uint32_t idx) {
+            interpreter::Function &callee = vm.functions[idx];
+            interpreter::Value v;
+            v.set_callable(static_cast<int>(idx));
+            callable = v.as_uint64();
+            func = &callee;
+            code = &callee.jitted;
+            bound = vm.stack + vm.stack_memory.capacity() - callee.max_stack;
+        }
+    };
 
     struct JitRuntime {
 
@@ -52,6 +98,8 @@ namespace jit {
 
     private:
         asmjit::JitRuntime asmrt;
+        // call sites of all the compiled code, the code points into them
+        std::deque<CallCache> caches;
     };
 
     struct JitFuncInfo {
@@ -60,177 +108,223 @@ namespace jit {
         asmjit::CodeHolder &holder;
         asmjit::x86::Compiler cc;
         asmjit::x86::Gp arg1, arg2;
+        // Machine registers that hold VM registers for the whole function, invalid for the ones left
+        // in their stack slots. The slot of a promoted register is written only by spill()
+        std::vector<asmjit::x86::Gp> promoted;
+        // code[ip] of the instruction being compiled
+        uint32_t ip = 0;
+        // deopt exits and the instruction each one resumes at
+        std::vector<std::pair<uint32_t, asmjit::Label>> exits;
+        // see leave(), unbound while no call needs it
+        asmjit::Label left;
+        // type_part every path to the instruction being compiled leaves in a register, TYPE_UNKNOWN if they
+        // may differ or it is an object
+        std::vector<uint32_t> types;
 
         inline JitFuncInfo(asmjit::JitRuntime &jit, asmjit::CodeHolder &holder, interpreter::VMData &vm) : asmrt(jit),
+                                                                                                           vm(vm),
                                                                                                            holder(holder),
-                                                                                                           cc(&this->holder),
-                                                                                                           vm(vm) {}
+                                                                                                           cc(&this->holder) {}
+
+        [[nodiscard]] bool is_promoted(int r) const {
+            return r < static_cast<int>(promoted.size()) && promoted[r].isValid();
+        }
+
+        // the stack slot of r, disp 4 is its type_part
+        [[nodiscard]] asmjit::x86::Mem slot(int r, int disp = 0) const {
+            return asmjit::x86::dword_ptr(arg1, r * 8 + disp);
+        }
+
+        // the whole Value of r: its machine register or a copy of its slot
+        asmjit::x86::Gp value(int r);
+
+        // the whole Value of r as an operand: its machine register or its slot
+        asmjit::Operand whole(int r);
+
+        // the low half of r, the payload of an int or a float: its machine register or its slot
+        asmjit::Operand payload(int r);
+
+        asmjit::x86::Vec load_float(int r);
+
+        // sets the flags for type_part of r against type
+        void cmp_type(int r, uint32_t type);
+
+        [[nodiscard]] uint32_t known(int r) const {
+            return r < static_cast<int>(types.size()) ? types[r] : TYPE_UNKNOWN;
+        }
+
+        // jumps to miss unless r has the type, checked only if it is not known
+        void guard(int r, uint32_t type, const asmjit::Label &miss);
+
+        // Exit of a failed guard of the current instruction: spills every promoted register, points vm.ip at
+        // the instruction and returns ERR_TYPE. No instruction writes anything before its guards, so the
+        // interpreter runs it again from the start
+        asmjit::Label fail();
+
+        // Exit of a call that left to the interpreter: returns ERR_LEAVE. The call spilled the promoted
+        // registers before, and the slots above its frame belong to the callee now, so nothing is spilled
+        asmjit::Label leave();
+
+        void emit_exits();
+
+        void set_value(int r, const asmjit::x86::Gp &v);
+
+        void set_const(int r, uint64_t bits);
+
+        // r = Value{payload, type}, payload is a 32-bit register
+        void set_typed(int r, uint32_t type, const asmjit::x86::Gp &payload);
+
+        void set_float(int r, const asmjit::x86::Vec &x);
 
+        // the stack slot of a promoted register gets its value, reload() takes the slot back after a call wrote it
+        void spill(int r);
+
+        void reload(int r);
+
+        void spill_all();
+
+        void reload_all();
+
+        // registers[a] = registers[b] <mtype> registers[c] for operands of the given type, jumps to miss
+        // for others
         template<int mtype>
         void
-        binary_operation(int a, int b, int c);
+        arith(int a, int b, int c, uint32_t type, const asmjit::Label &miss);
+
+        // expect is the type the interpreter saw the operands of, TYPE_UNKNOWN if it has not or the code
+        // does not speculate
+        template<int mtype>
+        void
+        binary_operation(int a, int b, int c, uint32_t expect);
 
         void modulo_operation(int a, int b, int c);
 
+        // calls a native, it may collect: the promoted registers go through their slots. Exits by leave() when
+        // the native throws
         void native_call3(void *func, int b, int c);
 
-        void native_call4(void *func, int a, int b, int c);
-
-        void op_arrget(int a, int b, int c);
-
-        void op_arrset(int a, int b, int c);
-
-        template<bool jmpT>
-        void cjmp(int a, const asmjit::Label &label) {
-            using namespace asmjit;
-            using namespace interpreter;
-            auto sf = cc.newLabel();
-            auto obj = cc.newLabel();
-            auto nxt = cc.newLabel();
-            {
-                cc.cmp(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-                cc.jne(sf);
-                cc.cmp(x86::dword_ptr(arg1, a * 8), 0);
-                if constexpr (jmpT) {
-                    cc.jne(label);
-                } else {
-                    cc.je(label);
-                }
-                cc.jmp(nxt);
-            }
-            {
-                cc.bind(sf);
-                const float cnst = 0.0f;
-                cc.cmp(x86::dword_ptr(arg1, a * 8 + 4), TYPE_FLOAT);
-                cc.jne(obj);
-                cc.cmp(x86::dword_ptr(arg1, a * 8), *reinterpret_cast<const int *>(&cnst));
-                if constexpr (jmpT) {
-                    cc.jne(label);
-                } else {
-                    cc.je(label);
-                }
-                cc.jmp(nxt);
-            }
-            {
-                cc.bind(obj);
-                cc.cmp(x86::dword_ptr(arg1, a * 8 + 4), TYPE_OBJ);
-                if constexpr (jmpT) {
-                    cc.jne(label);
-                } else {
-                    cc.je(label);
-                }
-                cc.jmp(nxt);
-            }
-            cc.bind(nxt);
-        }
+        // OP_CALL of the function in cache, filled if it can be called with c arguments: pushes the frame and
+        // calls the callee's code directly while it has some, the frame fits and vm.native_depth is below
+        // NATIVE_DEPTH_LIMIT, otherwise goes through interpreter::call_from_jit. Exits by leave() when the call
+        // is left to the interpreter
+        void call(const CallCache &cache, uint32_t idx, int b, int c, uint32_t return_ip);
+
+        // OP_INVOKEDYNAMIC: the call of call() while registers[a] holds the cached callee, otherwise
+        // interpreter::invoke_from_jit, which fills an empty cache
+        void invoke(const CallCache &cache, int a, int b, int c, uint32_t return_ip);
+
+        // the fast path of call() and invoke(), jumps to slow when it cannot call directly
+        void direct_call(const CallCache &cache, int b, uint32_t return_ip, const asmjit::Label &slow,
+                         const asmjit::Label &done);
+
+        // ip is the vm.ip the dispatch loop has while it runs the instruction. Both exit by leave() when the
+        // access throws
+        void op_arrget(int a, int b, int c, uint32_t ip);
+
+        void op_arrset(int a, int b, int c, uint32_t ip);
+
+        // safepoint of a loop back-edge: calls the collector while it has pending work, the frame stops at code[ip]
+        void gc_poll(uint32_t ip);
+
+        // OP_JMPT / OP_JMPF
+        void truth_jump(bool jmpT, int a, const asmjit::Label &label);
 
         void neg(int a, int b);
+
+        // fused compare-and-branch (OP_JEQ..OP_JNLE): jumps to label when the comparison holds,
+        // expect as for binary_operation
+        void cmp_jump(interpreter::OpCode op, int b, int c, const asmjit::Label &label, uint32_t expect);
+
+        // cmp_jump for operands of the given type, jumps to miss for others
+        void compare_branch(interpreter::OpCode op, int b, int c, uint32_t type, const asmjit::Label &label,
+                            const asmjit::Label &miss);
+
+        // registers[a] = registers[b] <op> k with k folded into the instruction, op is one of OP_ADD..OP_MOD
+        void const_operation(interpreter::OpCode op, int a, int b, const interpreter::Value &k);
+
+        // OP_TAILCALL of the function being compiled: moves the arguments down and jumps to entry,
+        // deopts if registers[a] holds another callable
+        void self_tail_call(int self, int a, int b, int c, const asmjit::Label &entry);
+
+        // fused compare-with-immediate (OP_EQI..OP_GEI): jumps to label when the comparison != negate
+        void cmp_imm_jump(interpreter::OpCode op, bool negate, int b, int32_t imm, const asmjit::Label &label);
     };
 
     template<int mtype>
     void
-    jit::JitFuncInfo::binary_operation(int a, int b, int c) {
+    jit::JitFuncInfo::arith(int a, int b, int c, uint32_t type, const asmjit::Label &miss) {
         using namespace interpreter;
         using namespace asmjit;
-        auto err = cc.newLabel();
-        auto sf = cc.newLabel();
-        auto nxt = cc.newLabel();
-
-        auto temp2 = cc.newUInt64();
-        auto temp3 = cc.newUInt64();
-
-        {//int * int
-            cc.cmp(x86::dword_ptr(arg1, b * 8 + 4), TYPE_INT);
-            cc.jne(sf);
-            cc.cmp(x86::dword_ptr(arg1, c * 8 + 4), TYPE_INT);
-            cc.jne(err);//sif
+        guard(b, type, miss);
+        guard(c, type, miss);
+        if (type == TYPE_INT) {
             auto temp = cc.newInt32();
-            cc.mov(temp, x86::ptr(arg1, b * 8));
-            interpreter::Value tempInt;
-            tempInt.set_int(0);
+            cc.emit(x86::Inst::kIdMov, temp, payload(b));
             if constexpr (mtype == interpreter::OP_ADD) {
-                cc.add(temp, x86::dword_ptr(arg1, c * 8));
+                cc.emit(x86::Inst::kIdAdd, temp, payload(c));
             } else if constexpr (mtype == interpreter::OP_SUB) {
-                cc.sub(temp, x86::dword_ptr(arg1, c * 8));
+                cc.emit(x86::Inst::kIdSub, temp, payload(c));
             } else if constexpr (mtype == interpreter::OP_MUL) {
-                cc.imul(temp, x86::dword_ptr(arg1, c * 8));
+                cc.emit(x86::Inst::kIdImul, temp, payload(c));
             } else if constexpr (mtype == interpreter::OP_DIV) {
-                cc.cmp(x86::dword_ptr(arg1, c * 8), 0);
-                cc.je(err);
+                cc.emit(x86::Inst::kIdCmp, payload(c), 0);
+                cc.je(fail());
                 x86::Gp dummy2 = cc.newInt32();
                 cc.cdq(dummy2, temp);
-                cc.idiv(dummy2, temp, x86::dword_ptr(arg1, c * 8));
-            } else if constexpr (mtype == interpreter::OP_LT) {
-                cc.cmp(temp, x86::dword_ptr(arg1, c * 8));
-                auto dummy = cc.newInt8();
-                cc.setl(dummy);
-                auto t2 = cc.newInt32();
-                cc.movzx(t2, dummy);
-                cc.mov(x86::dword_ptr(arg1, a * 8), t2);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-            } else if constexpr (mtype == interpreter::OP_LE) {
-                cc.cmp(temp, x86::dword_ptr(arg1, c * 8));
+                cc.emit(x86::Inst::kIdIdiv, dummy2, temp, payload(c));
+            } else {
+                cc.emit(x86::Inst::kIdCmp, temp, payload(c));
                 auto dummy = cc.newInt8();
-                cc.setle(dummy);
-                auto t2 = cc.newInt32();
-                cc.movzx(t2, dummy);
-                cc.mov(x86::dword_ptr(arg1, a * 8), t2);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
+                if constexpr (mtype == interpreter::OP_LT) cc.setl(dummy);
+                else cc.setle(dummy);
+                cc.movzx(temp, dummy);
             }
-            if constexpr (mtype != interpreter::OP_LT && mtype != interpreter::OP_LE) {
-                cc.mov(x86::dword_ptr(arg1, a * 8), temp);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-            }
-            cc.jmp(nxt);
+            set_typed(a, TYPE_INT, temp);
+            return;
         }
-        {
-            interpreter::Value tempInt;
-            tempInt.set_float(0);
-            //TODO: float * float
-            cc.bind(sf);
-            cc.cmp(x86::dword_ptr(arg1, b * 8 + 4), TYPE_FLOAT);
-            cc.jne(err);
-            cc.cmp(x86::dword_ptr(arg1, c * 8 + 4), TYPE_FLOAT);
-            cc.jne(err);//sfi
-            auto temp = cc.newXmmSs();
-            cc.movss(temp, x86::dword_ptr(arg1, b * 8));
-            if constexpr (mtype == interpreter::OP_ADD) {
-                cc.addss(temp, x86::qword_ptr(arg1, c * 8));
-            } else if constexpr (mtype == interpreter::OP_SUB) {
-                cc.subss(temp, x86::qword_ptr(arg1, c * 8));
-            } else if constexpr (mtype == interpreter::OP_MUL) {
-                cc.mulss(temp, x86::qword_ptr(arg1, c * 8));
-            } else if constexpr (mtype == interpreter::OP_DIV) {
-                cc.divss(temp, x86::qword_ptr(arg1, c * 8));
-            } else if constexpr (mtype == interpreter::OP_LT) {
-                cc.comiss(temp, x86::qword_ptr(arg1, c * 8));
-                cc.setl(x86::al);
-                cc.mov(x86::dword_ptr(arg1, a * 8), x86::al);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-
-            } else if constexpr (mtype == interpreter::OP_LE) {
-                cc.comiss(temp, x86::qword_ptr(arg1, c * 8));
-                cc.setle(x86::al);
-                cc.mov(x86::dword_ptr(arg1, a * 8), x86::al);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_INT);
-            }
-            if constexpr (mtype != interpreter::OP_LT && mtype != interpreter::OP_LE) {
-                cc.movd(x86::qword_ptr(arg1, a * 8), temp);
-                cc.mov(x86::dword_ptr(arg1, a * 8 + 4), TYPE_FLOAT);
-            }
-            cc.jmp(nxt);
+        auto temp = load_float(b);
+        auto rhs = load_float(c);
+        if constexpr (mtype == interpreter::OP_ADD) {
+            cc.addss(temp, rhs);
+        } else if constexpr (mtype == interpreter::OP_SUB) {
+            cc.subss(temp, rhs);
+        } else if constexpr (mtype == interpreter::OP_MUL) {
+            cc.mulss(temp, rhs);
+        } else if constexpr (mtype == interpreter::OP_DIV) {
+            cc.divss(temp, rhs);
+        } else {
+            // compared as c > b so that NaN makes the comparison false
+            auto dummy = cc.newInt8();
+            auto res = cc.newInt32();
+            cc.comiss(rhs, temp);
+            if constexpr (mtype == interpreter::OP_LT) cc.seta(dummy);
+            else cc.setae(dummy);
+            cc.movzx(res, dummy);
+            set_typed(a, TYPE_INT, res);
         }
+        if constexpr (mtype != interpreter::OP_LT && mtype != interpreter::OP_LE) {
+            set_float(a, temp);
+        }
+    }
 
-
-        cc.bind(err);
-        auto failCode = cc.newUInt64();
-        cc.movabs(failCode, OBJ_NIL);
-        cc.add(failCode, 1);
-        cc.ret(failCode);
+    template<int mtype>
+    void
+    jit::JitFuncInfo::binary_operation(int a, int b, int c, uint32_t expect) {
+        using namespace interpreter;
+        using namespace asmjit;
+        // only the profiled types are compiled, the others deopt
+        const uint32_t type = speculated_type(known(b), known(c), expect);
+        if (type != TYPE_UNKNOWN) {
+            arith<mtype>(a, b, c, type, fail());
+            return;
+        }
+        auto sf = cc.newLabel();
+        auto nxt = cc.newLabel();
+        arith<mtype>(a, b, c, TYPE_INT, sf);
+        cc.jmp(nxt);
+        cc.bind(sf);
+        arith<mtype>(a, b, c, TYPE_FLOAT, fail());
         cc.bind(nxt);
-
-//    cc.movabs(temp2, 18446744069414584320ull);
-//    cc.and_(stack[a], temp2);
     }
 }
 
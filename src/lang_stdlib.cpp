@@ -13,7 +13,7 @@ void cote_len(interpreter::VMData &vm, int reg, int cnt) {
     if (cnt != 1) throw std::runtime_error("expected only one arg: array");
     auto &cur = vm.stack[vm.fp + reg];
     if (!cur.is_array()) throw std::runtime_error("expected only one arg: array");
-    auto *obj = heap::mem.at(cur.object_ptr);
+    auto *obj = vm.gc.resolve(cur.object_ptr);
     assert(obj);
     vm.stack[vm.fp + reg].set_int(static_cast<int>(obj->get_len()));
 }
@@ -28,6 +28,7 @@ void cote_print(interpreter::VMData &vm, int reg, int cnt) {
         else if (cur.is_nil()) std::cout << "nil ";
         else throw std::runtime_error("todo");
     }
+    vm.stack[off].set_nil();
 }
 
 void cote_print_(interpreter::VMData &vm, int reg, int cnt) {
@@ -40,6 +41,7 @@ void cote_print_(interpreter::VMData &vm, int reg, int cnt) {
         else if (cur.is_nil()) std::cout << "nil";
         else throw std::runtime_error("todo");
     }
+    vm.stack[off].set_nil();
 }
 
 
@@ -107,36 +109,47 @@ void ASSERT(interpreter::VMData& vm, int reg, int cnt) {
     for (int i = 0; i < cnt; ++i) {
         assert(vm.stack[vm.fp + reg + i].i32 == 1 && "FALSE CONDITION");
     }
+    vm.stack[vm.fp + reg].set_nil();
 }
 
 // force gc call
-void GC_CALL(interpreter::VMData &vm, int, int cnt) {
+void GC_CALL(interpreter::VMData &vm, int reg, int cnt) {
     if (cnt) {
         throw std::runtime_error("no args expected");
     }
     vm.gc.call();
+    vm.stack[vm.fp + reg].set_nil();
 }
 
 
+namespace {
+    void add_native(interpreter::VMData &data, parser::VarManager &vars, const std::string &name,
+                    interpreter::NativeFunction func) {
+        const size_t id = vars.add_native(name);
+        if (data.natives.size() <= id) data.natives.resize(id + 1);
+        data.natives[id] = func;
+    }
+}
+
 void cote_stdlib::initStdlib(interpreter::VMData &data, parser::VarManager &vars) {
-    data.natives[vars.add_native("print")] = cote_print;
-    data.natives[vars.add_native("str")] = cote_str;
-    data.natives[vars.add_native("println")] = cote_println;
-    data.natives[vars.add_native("len")] = cote_len;
-    data.natives[vars.add_native("rand")] = cote_rand;
-    data.natives[vars.add_native("throw")] = cote_throw;
+    add_native(data, vars, "print", cote_print);
+    add_native(data, vars, "str", cote_str);
+    add_native(data, vars, "println", cote_println);
+    add_native(data, vars, "len", cote_len);
+    add_native(data, vars, "rand", cote_rand);
+    add_native(data, vars, "throw", cote_throw);
     // GC MONITOR NATIVES:
-    data.natives[vars.add_native("GET_OBJECTS")] = GET_OBJECTS;
-    data.natives[vars.add_native("GET_YOUNG")] = GET_YOUNG;
-    data.natives[vars.add_native("GET_LARGE")] = GET_LARGE;
-    data.natives[vars.add_native("GET_OLD")] = GET_OLD;
-    data.natives[vars.add_native("GC_CALL")] = GC_CALL;
+    add_native(data, vars, "GET_OBJECTS", GET_OBJECTS);
+    add_native(data, vars, "GET_YOUNG", GET_YOUNG);
+    add_native(data, vars, "GET_LARGE", GET_LARGE);
+    add_native(data, vars, "GET_OLD", GET_OLD);
+    add_native(data, vars, "GC_CALL", GC_CALL);
 
     // just prints without space after ints
     // check code better
-    data.natives[vars.add_native("print_")] = cote_print_;
+    add_native(data, vars, "print_", cote_print_);
 
     // ASSERT
-    data.natives[vars.add_native("ASSERT")] = ASSERT;
+    add_native(data, vars, "ASSERT", ASSERT);
 }
 
@@ -34,13 +34,14 @@ namespace parser {
         std::istream &in;
     };
 
-    int cur_char = ' ';
-    SimpleStream in(NULL_STREAM);
-    void *m_stream_ptr = &in;
+    // lexer state is per thread, so separate threads can parse separate programs
+    thread_local int cur_char = ' ';
+    thread_local SimpleStream in(NULL_STREAM);
+    thread_local void *m_stream_ptr = &in;
 
-    TokenData cur = {};
-    TokenData prv = {};
-    TokenData nxt = {.token = -1};
+    thread_local TokenData cur = {};
+    thread_local TokenData prv = {};
+    thread_local TokenData nxt = {.token = -1};
 
     int helper_return_char(int TOKEN) {
         cur_char = in.get();
@@ -56,8 +56,8 @@ namespace parser {
         int lines = 0;
         int cnt = 0;
     };
-    extern TokenData cur;
-    extern TokenData prv;
+    extern thread_local TokenData cur;
+    extern thread_local TokenData prv;
 
 
     void keep_newlines();
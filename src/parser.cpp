@@ -18,10 +18,11 @@ namespace {
     using namespace ast;
     using namespace parser;
 
-    interpreter::BytecodeEmitter *emitter;
-    VarManager vars;
-    std::vector<LoopManager> loops;
-    int jmp_uid = 0;
+    // parser state is per thread, like the lexer's
+    thread_local interpreter::BytecodeEmitter *emitter;
+    thread_local VarManager vars;
+    thread_local std::vector<LoopManager> loops;
+    thread_local int jmp_uid = 0;
 
     bool match(int token_type) {
         if (token_type != cur.token) return false;
@@ -290,11 +291,12 @@ namespace parser {
     void if_statement() {
         if (!match(TOKEN_LPAREN))
             parser_throws(error_msg("( after if keyword"));
-        if (!epush(parse_expression())) return;
+        auto cond = parse_expression();
+        if (!cond) return;
         if (!match(TOKEN_RPAREN))
             parser_throws(error_msg("closing ) in if statement"));
         const int cur_id1 = jmp_uid++;
-        emitter->jmpf_label(vars.pop_var(), cur_id1);
+        ejump(cond.get(), false, cur_id1);
 
         if (match(TOKEN_LCURLY)) {
             parse_block();
@@ -341,8 +343,7 @@ namespace parser {
         loops.emplace_back(start_id, end_id);
         vars.new_scope();
         auto cond = parse_expression();
-        epush(cond.get());
-        emitter->jmpf_label(vars.pop_var(), end_id);
+        ejump(cond.get(), false, end_id);
         emitter->label(start_id);
         if (!match(TOKEN_RPAREN))
             parser_throws(error_msg(") in while statement"));
@@ -351,8 +352,7 @@ namespace parser {
         } else {
             parse_statement();
         }
-        epush(cond.get());
-        emitter->jmpt_label(vars.pop_var(), start_id);
+        ejump(cond.get(), true, start_id);
         emitter->label(end_id);
 
         vars.close_scope();
@@ -372,6 +372,14 @@ namespace parser {
         auto lhs = std::move(curv->l);
         auto rhs = std::move(curv->r);
         delete curv;
+        if (is_assignment > 1 && lhs->get_type() == ast::NodeType::Var) {
+            // x += <literal> and friends
+            static constexpr ast::BinaryOpType ops[] = {ast::BinaryOpType::ADD, ast::BinaryOpType::SUB,
+                                                        ast::BinaryOpType::MUL, ast::BinaryOpType::DIV};
+            const int res = vars.get_var(dynamic_cast<VarExpr *>(lhs.get())->name);
+            if (res != -1 && rhs && emit_literal_operand(ops[is_assignment - 2], res, res, rhs.get(), *emitter))
+                return;
+        }
         if (!epush(std::move(rhs))) {
             return;
         }
@@ -460,8 +468,7 @@ namespace parser {
         loops.emplace_back(start_id, end_id);
 
         auto cond = parse_expr_sc();
-        epush(cond.get());
-        emitter->jmpf_label(vars.pop_var(), end_id);
+        ejump(cond.get(), false, end_id);
         emitter->label(start_id);
         //HERE: should be parse_assignment
         int is_assignment = 0;
@@ -470,8 +477,7 @@ namespace parser {
         if (match(TOKEN_LCURLY)) parse_block<false, false>();
         else parse_statement();
         push_assign(std::move(incExpr), is_assignment);
-        epush(cond.get());
-        emitter->jmpt_label(vars.pop_var(), start_id);
+        ejump(cond.get(), true, start_id);
         emitter->label(end_id);
 
         vars.close_scope();
@@ -545,7 +551,6 @@ namespace parser {
             vars.push_var(cur);
         }
         parse_block<false>();
-        //TODO: tail call
         //add return in case control flow leaks
         emitter->emit_retnil();
         emitter->end_func();
@@ -553,10 +558,14 @@ namespace parser {
 
 
     void init_parser(std::istream &in, interpreter::BytecodeEmitter *emit) {
+        init_parser(in, emit, interpreter::vm_instance());
+    }
+
+    void init_parser(std::istream &in, interpreter::BytecodeEmitter *emit, interpreter::VMData &vm) {
         init_lexer(in);
         emitter = emit;
         vars = VarManager();
-        cote_stdlib::initStdlib(interpreter::vm_instance(), vars);
+        cote_stdlib::initStdlib(vm, vars);
         init_exceptions();
     }
 
@@ -567,9 +576,17 @@ namespace parser {
         return true;
     }
 
+    bool ejump(ast::Node *expr, bool jump_if, int label) {
+        if (expr == nullptr) return false;
+        if (!parser::eval_cond_jump(expr, jump_if, label, *emitter, vars))
+            throw std::runtime_error("error parsing expression");
+        return true;
+    }
+
     void parse_return() {
-        epush(parse_expr_sc());
-        //TODO: tail call
+        auto expr = parse_expr_sc();
+        if (expr != nullptr && parser::eval_tail_call(expr.get(), *emitter, vars)) return;
+        epush(std::move(expr));
         emitter->emit_return(vars.pop_var());
     }
 
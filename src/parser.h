@@ -63,9 +63,15 @@ namespace parser {
 
     void init_parser(std::istream &in, interpreter::BytecodeEmitter *emitter);
 
+    // Same, with the natives registered in vm, which the program is then parsed into
+    void init_parser(std::istream &in, interpreter::BytecodeEmitter *emitter, interpreter::VMData &vm);
+
     bool epush(ast::Node *expr);
 
     inline bool epush(std::unique_ptr<ast::Node> expr) { return epush(expr.get()); }
+
+    // emits a jump to label taken when expr is truthy (jump_if) or falsy (!jump_if)
+    bool ejump(ast::Node *expr, bool jump_if, int label);
 }
 
 
@@ -0,0 +1,267 @@
+//
+// Registers of a stopped frame the collector has to scan
+//
+
+#include "stack_map.h"
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+
+#include "vm.h"
+
+namespace {
+    using namespace interpreter;
+
+    // What an instruction does to the registers of its frame
+    struct Step {
+        // [begin, end) ranges of registers read
+        uint32_t uses[3][2] = {};
+        int64_t def = -1;
+        // the written register holds a collected value only if this one does, for moves
+        int64_t copy_of = -1;
+        // the callee frame starts right above the result of a call, these registers hold its values afterwards
+        uint32_t clobber_from = UINT32_MAX;
+        // instructions that may run next, -1 for none
+        int64_t next[2] = {-1, -1};
+    };
+
+    Step decode(const std::vector<uint32_t> &code, const Function &func, uint32_t k) {
+        Step s;
+        const uint32_t instr = code[func.entry_point + k];
+        const int64_t after = k + 1;
+        // a prefix stops the frame in the same state as the instruction it widens
+        if (instr >> OPCODE_SHIFT == OP_EXTRAARG) {
+            s.next[0] = after;
+            return s;
+        }
+        const uint32_t prev = k > 0 ? code[func.entry_point + k - 1] : 0;
+        const uint32_t ax = k > 0 && prev >> OPCODE_SHIFT == OP_EXTRAARG ? prev & AX_ARG : 0;
+        const uint32_t a = wide_a(instr, ax);
+        const uint32_t b = wide_b(instr, ax);
+        const uint32_t c = wide_c(instr, ax);
+        const uint32_t bx = wide_bx(instr, ax);
+        auto use = [&s](int i, uint32_t from, uint32_t to) {
+            s.uses[i][0] = from;
+            s.uses[i][1] = to;
+        };
+        // a fused compare either takes the OP_JMP after it or skips it
+        auto fused = [&]() {
+            s.next[0] = after + 1;
+            s.next[1] = after + 1 + jump_offset(code[func.entry_point + after]);
+        };
+        s.next[0] = after;
+        switch (unquickened(static_cast<OpCode>(instr >> OPCODE_SHIFT))) {
+            case OP_LOADINT:
+            case OP_LOADNIL:
+            case OP_LOADFUNC:
+            case OP_LOADFLOAT:
+                s.def = a;
+                break;
+            case OP_MOVE:
+                s.def = a;
+                s.copy_of = b;
+                use(0, b, b + 1);
+                break;
+            case OP_NEG:
+            case OP_ALLOC:
+            case OP_ADDI:
+            case OP_SUBI:
+            case OP_MULI:
+            case OP_ADDK:
+            case OP_SUBK:
+            case OP_MULK:
+            case OP_DIVK:
+            case OP_MODK:
+                s.def = a;
+                use(0, b, b + 1);
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_MOD:
+            case OP_EQ:
+            case OP_NEQ:
+            case OP_LT:
+            case OP_LE:
+            case OP_ARRGET:
+                s.def = a;
+                use(0, b, b + 1);
+                use(1, c, c + 1);
+                break;
+            case OP_ARRSET:
+                use(0, a, a + 1);
+                use(1, b, b + 1);
+                use(2, c, c + 1);
+                break;
+            case OP_JMP:
+                s.next[0] = after + jump_offset(instr);
+                break;
+            case OP_JMPT:
+            case OP_JMPF:
+                use(0, a, a + 1);
+                s.next[1] = after + static_cast<int32_t>(bx) - static_cast<int32_t>(J_ZERO);
+                break;
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JLT:
+            case OP_JLE:
+            case OP_JNLT:
+            case OP_JNLE:
+                use(0, b, b + 1);
+                use(1, c, c + 1);
+                fused();
+                break;
+            case OP_EQI:
+            case OP_LTI:
+            case OP_LEI:
+            case OP_GTI:
+            case OP_GEI:
+                use(0, b, b + 1);
+                fused();
+                break;
+            case OP_INVOKEDYNAMIC:
+                use(1, a, a + 1);
+                [[fallthrough]];
+            case OP_CALL:
+                use(0, b, b + c);
+                s.def = b;
+                s.clobber_from = b + 1;
+                break;
+            case OP_NATIVE_CALL:
+                use(0, b, b + c);
+                s.def = b;
+                break;
+            case OP_TAILCALL:
+                use(0, b, b + c);
+                use(1, a, a + 1);
+                s.next[0] = -1;
+                break;
+            case OP_RETURN:
+                use(0, a, a + 1);
+                s.next[0] = -1;
+                break;
+            case OP_RETURNNIL:
+            case OP_HALT:
+                s.next[0] = -1;
+                break;
+            default:
+                throw std::runtime_error("stack map: unknown opcode");
+        }
+        return s;
+    }
+
+    // bit sets over the registers of a frame, `words` words each
+    void set_bit(uint64_t *set, uint32_t words, int64_t r, bool val) {
+        if (r < 0 || r >= words * 64) return;
+        const uint64_t bit = uint64_t{1} << (r & 63);
+        if (val) set[r >> 6] |= bit;
+        else set[r >> 6] &= ~bit;
+    }
+
+    bool get_bit(const uint64_t *set, uint32_t words, int64_t r) {
+        return r >= 0 && r < words * 64 && (set[r >> 6] >> (r & 63) & 1);
+    }
+
+    void clear_from(uint64_t *set, uint32_t words, uint32_t from) {
+        for (uint32_t w = 0; w < words; ++w) {
+            if (w * 64 >= from) set[w] = 0;
+            else if (from - w * 64 < 64) set[w] &= (uint64_t{1} << (from - w * 64)) - 1;
+        }
+    }
+}
+
+void interpreter::build_stack_map(const std::vector<uint32_t> &code, Function &func) {
+    const uint32_t n = func.code_size;
+    const uint32_t words = (func.max_stack + 63) / 64;
+    std::vector<Step> steps(n);
+    for (uint32_t k = 0; k < n; ++k) {
+        steps[k] = decode(code, func, k);
+    }
+    auto valid = [n](int64_t k) { return k >= 0 && k < n; };
+    std::vector<uint64_t> tmp(words);
+
+    // registers read on some path from an instruction, backwards to a fixpoint
+    std::vector<uint64_t> live(static_cast<size_t>(n) * words);
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t k = n; k-- > 0;) {
+            const Step &s = steps[k];
+            std::fill(tmp.begin(), tmp.end(), 0);
+            for (auto next: s.next) {
+                if (!valid(next)) continue;
+                for (uint32_t w = 0; w < words; ++w) tmp[w] |= live[next * words + w];
+            }
+            set_bit(tmp.data(), words, s.def, false);
+            clear_from(tmp.data(), words, s.clobber_from);
+            for (auto &range: s.uses) {
+                for (uint32_t r = range[0]; r < range[1]; ++r) set_bit(tmp.data(), words, r, true);
+            }
+            if (!std::equal(tmp.begin(), tmp.end(), live.begin() + k * words)) {
+                std::copy(tmp.begin(), tmp.end(), live.begin() + k * words);
+                changed = true;
+            }
+        }
+    }
+
+    // registers every path from the entry wrote, forwards to a fixpoint; the arguments are written by the caller
+    std::vector<uint64_t> written(static_cast<size_t>(n) * words);
+    std::vector<bool> reached(n);
+    if (n > 0) {
+        for (uint32_t r = 0; r < func.arity; ++r) set_bit(written.data(), words, r, true);
+        reached[0] = true;
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (uint32_t k = 0; k < n; ++k) {
+            if (!reached[k]) continue;
+            const Step &s = steps[k];
+            std::copy(written.begin() + k * words, written.begin() + (k + 1) * words, tmp.begin());
+            clear_from(tmp.data(), words, s.clobber_from);
+            if (s.def >= 0) {
+                set_bit(tmp.data(), words, s.def, s.copy_of < 0 || get_bit(written.data() + k * words, words, s.copy_of));
+            }
+            for (auto next: s.next) {
+                if (!valid(next)) continue;
+                uint64_t *in = written.data() + next * words;
+                for (uint32_t w = 0; w < words; ++w) {
+                    const uint64_t merged = reached[next] ? in[w] & tmp[w] : tmp[w];
+                    changed |= merged != in[w] || !reached[next];
+                    in[w] = merged;
+                }
+                reached[next] = true;
+            }
+        }
+    }
+
+    func.stack_map.resize(static_cast<size_t>(n) * words);
+    for (size_t i = 0; i < func.stack_map.size(); ++i) {
+        func.stack_map[i] = live[i] & written[i];
+    }
+}
+
+void interpreter::append_live_slots(const Function &func, uint32_t ip, uint32_t fp, uint32_t limit,
+                                    std::vector<uint32_t> &out) {
+    const uint32_t end = std::min(limit, func.max_stack);
+    const uint32_t k = ip - func.entry_point;
+    if (func.stack_map.empty()) {
+        // a frame without a map is nil-filled on entry and scanned whole
+        for (uint32_t r = 0; r < end; ++r) out.push_back(fp + r);
+        return;
+    }
+    if (k >= func.code_size) {
+        // not stopped at one of its instructions, only the arguments are known to be written
+        for (uint32_t r = 0; r < std::min<uint32_t>(end, func.arity); ++r) out.push_back(fp + r);
+        return;
+    }
+    const uint32_t words = (func.max_stack + 63) / 64;
+    const uint64_t *map = func.stack_map.data() + static_cast<size_t>(k) * words;
+    for (uint32_t w = 0; w < words; ++w) {
+        for (uint64_t bits = map[w]; bits; bits &= bits - 1) {
+            const uint32_t r = w * 64 + std::countr_zero(bits);
+            if (r >= end) return;
+            out.push_back(fp + r);
+        }
+    }
+}
@@ -0,0 +1,26 @@
+//
+// Registers of a stopped frame the collector has to scan
+//
+
+#ifndef COTE_STACK_MAP_H
+#define COTE_STACK_MAP_H
+
+#include <cstdint>
+#include <vector>
+
+#include "value.h"
+
+namespace interpreter {
+    // Computes func.stack_map from code[func.entry_point, func.entry_point + func.code_size).
+    // A register is in the map of an instruction when it is read on some path from there, and every path
+    // from the entry wrote it after the last call that could leave a callee's value in it.
+    // Such a slot holds a value the collector kept up to date, the others are never scanned or cleared
+    void build_stack_map(const std::vector<uint32_t> &code, Function &func);
+
+    // Appends fp + r for every register r < limit in the map of the instruction at code[ip].
+    // A frame stops before an instruction at a gc poll and inside it at an allocation or a call
+    void append_live_slots(const Function &func, uint32_t ip, uint32_t fp, uint32_t limit,
+                           std::vector<uint32_t> &out);
+}
+
+#endif //COTE_STACK_MAP_H
@@ -0,0 +1,44 @@
+//
+// Value stack storage of the VM
+//
+
+#include "stack_memory.h"
+
+#include <stdexcept>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define COTE_MMAP_STACK 1
+#else
+#define COTE_MMAP_STACK 0
+#endif
+
+interpreter::StackMemory::StackMemory(size_t capacity) : capacity_(capacity) {
+#if COTE_MMAP_STACK
+    const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t bytes = (capacity * sizeof(Value) + page - 1) / page * page;
+    mapped_bytes_ = bytes + page;
+    void *mem = mmap(nullptr, mapped_bytes_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+        throw std::runtime_error("cannot reserve VM stack");
+    }
+    // a write past the end faults instead of corrupting whatever is mapped after the stack
+    if (mprotect(static_cast<char *>(mem) + bytes, page, PROT_NONE) != 0) {
+        munmap(mem, mapped_bytes_);
+        throw std::runtime_error("cannot protect VM stack guard page");
+    }
+    data_ = static_cast<Value *>(mem);
+#else
+    data_ = new Value[capacity]();
+#endif
+}
+
+interpreter::StackMemory::~StackMemory() {
+#if COTE_MMAP_STACK
+    munmap(data_, mapped_bytes_);
+#else
+    delete[] data_;
+#endif
+}
@@ -0,0 +1,38 @@
+//
+// Value stack storage of the VM
+//
+
+#ifndef COTE_STACK_MEMORY_H
+#define COTE_STACK_MEMORY_H
+
+#include <cstddef>
+
+#include "value.h"
+
+namespace interpreter {
+    // Address space for `capacity` Values reserved once and followed by an inaccessible guard page.
+    // The OS commits pages on first touch, so a large reservation is cheap and the stack never moves:
+    // pointers into it (registers of the dispatch loop, frames of jitted code) stay valid.
+    class StackMemory {
+    public:
+        explicit StackMemory(size_t capacity);
+
+        ~StackMemory();
+
+        StackMemory(const StackMemory &) = delete;
+
+        StackMemory &operator=(const StackMemory &) = delete;
+
+        [[nodiscard]] Value *data() const { return data_; }
+
+        // number of usable Values, the guard page is not counted
+        [[nodiscard]] size_t capacity() const { return capacity_; }
+
+    private:
+        Value *data_;
+        size_t capacity_;
+        size_t mapped_bytes_ = 0;
+    };
+}
+
+#endif //COTE_STACK_MEMORY_H
@@ -5,24 +5,25 @@
 #ifndef VALUE_H
 #define VALUE_H
 
+#include <cassert>
 #include <cstdint>
+#include <cstddef>
+#include <vector>
 
 
 namespace interpreter {
     static constexpr uint32_t TYPE_OBJ = 1;
-    static constexpr uint32_t MARK_BIT = 2;
     static constexpr uint32_t TYPE_INT = 4;
     static constexpr uint32_t TYPE_FLOAT = 8;
     static constexpr uint32_t TYPE_CALLABLE = 12;
     static constexpr uint32_t TYPE_NIL = 16;
-    static constexpr uint32_t UNMARK_BITS = ~MARK_BIT;
     static constexpr uint64_t OBJ_NIL = (uint64_t) TYPE_NIL << 32ull;
 
     // type_part:
     // now is only array
     // static constexpr uint32_t type_part_obj_ = 0b000000000000000000000000000000'0/1'1;
     //                                           | space for array len            |   | is_array
-    //                                                                             mark for gc
+    //                                                                             unused, the gc keeps its marks aside
 
     // in future objects third low bit will mean array/object
     // non-objects: xxx100 - int
@@ -44,22 +45,7 @@ namespace interpreter {
         Value() {
         }
 
-        void mark() { type_part |= MARK_BIT; }
-
-        void unmark() { type_part &= UNMARK_BITS; }
-
-        // TODO simplify
-        void flip_mark() {
-            type_part ^= MARK_BIT;
-        }
-
-        bool is_marked() const { return type_part & MARK_BIT; }
-
-        uint64_t as_unmarked() const {
-            return (static_cast<uint64_t>(UNMARK_BITS & type_part) << 32ull) | static_cast<uint64_t>(i32);
-        }
-
-        inline int32_t get_class() const { return (type_part >> 2) & 1; } //1 for obj type; 1 for mark bit, & 1 bc size
+        inline int32_t get_class() const { return (type_part >> 2) & 1; } //1 for obj type, & 1 bc size
 
         uint32_t get_len() {
             return type_part >> 2;
@@ -85,24 +71,22 @@ namespace interpreter {
             f32 = val;
         }
 
-        template<bool marked = false>
         inline void set_obj(const uint32_t class_info, Value *ptr_val) {
-            type_part = class_info << 2ull | TYPE_OBJ | static_cast<uint32_t>(marked) << 1;
+            type_part = class_info << 2ull | TYPE_OBJ;
             assert(ptr_val);
             // object_ptr = !class_info ? 0 : ptr_val->object_ptr; // set nullptr to nil or objectptr
             object_ptr = ptr_val->object_ptr;
         }
 
-        template<bool marked = true>
         inline void set_array(const uint32_t size, Value *ptr_val) {
-            set_obj<marked>(size, ptr_val);
+            set_obj(size, ptr_val);
         }
 
-        inline bool is_nil() const { return as_unmarked() == OBJ_NIL; }
+        inline bool is_nil() const { return as_uint64() == OBJ_NIL; }
 
-        inline bool is_int() const { return (type_part & UNMARK_BITS) == TYPE_INT; }
+        inline bool is_int() const { return type_part == TYPE_INT; }
 
-        inline bool is_float() const { return (type_part & UNMARK_BITS) == TYPE_FLOAT; }
+        inline bool is_float() const { return type_part == TYPE_FLOAT; }
 
         //TODO: add char support
 
@@ -110,14 +94,14 @@ namespace interpreter {
 
         inline bool is_array() const { return is_object(); }
 
-        inline bool is_callable() const { return (type_part & UNMARK_BITS) == TYPE_CALLABLE; }
+        inline bool is_callable() const { return type_part == TYPE_CALLABLE; }
 
         //only for numeric types
         inline float cast_to_float() const {
             return is_float() ? f32 : static_cast<float>(i32);
         }
 
-        inline uint64_t as_uint64() { return *reinterpret_cast<uint64_t *>(this); }
+        inline uint64_t as_uint64() const { return *reinterpret_cast<const uint64_t *>(this); }
     };
 
 
@@ -126,10 +110,15 @@ namespace interpreter {
         uint32_t entry_point;
         uint8_t arity;
         uint32_t code_size = 0;
-        uint32_t max_stack = 120;
+        // registers of a frame, set from the code by BytecodeEmitter::initVM
+        uint32_t max_stack = 0;
         uint32_t hotness = 0;
         bool banned = false;
         mFuncCompiled jitted = nullptr;
+        // failed guards of the jitted code, each resumed the call in the interpreter
+        uint32_t deopts = 0;
+        // (max_stack + 63) / 64 words per instruction, see stack_map.h
+        std::vector<uint64_t> stack_map;
     };
 
     struct CallFrame {
@@ -137,6 +126,58 @@ namespace interpreter {
         uint32_t base_ptr;
         Function *cur_func;
     };
+
+    // Frames of the active calls in one contiguous array, it only allocates when the call depth doubles
+    class CallStack {
+    public:
+        explicit CallStack(size_t capacity) : frames_(capacity), next_(frames_.data()),
+                                              limit_(frames_.data() + frames_.size()) {}
+
+        // next_ and limit_ point into frames_
+        CallStack(const CallStack &) = delete;
+
+        CallStack &operator=(const CallStack &) = delete;
+
+        void push(const CallFrame &frame) {
+            if (next_ == limit_) grow();
+            *next_++ = frame;
+        }
+
+        void pop() { --next_; }
+
+        CallFrame &top() { return next_[-1]; }
+
+        const CallFrame &top() const { return next_[-1]; }
+
+        [[nodiscard]] bool empty() const { return next_ == frames_.data(); }
+
+        [[nodiscard]] size_t size() const { return next_ - frames_.data(); }
+
+        void clear() { next_ = frames_.data(); }
+
+        // active frames, from the outermost one
+        CallFrame *begin() { return frames_.data(); }
+
+        CallFrame *end() { return next_; }
+
+        // Jitted code pushes and pops frames in place: a frame goes to *next_slot() while it is below
+        // *limit_slot(), otherwise through push()
+        CallFrame **next_slot() { return &next_; }
+
+        CallFrame **limit_slot() { return &limit_; }
+
+    private:
+        void grow() {
+            const size_t size = this->size();
+            frames_.resize(frames_.size() * 2 + 1);
+            next_ = frames_.data() + size;
+            limit_ = frames_.data() + frames_.size();
+        }
+
+        std::vector<CallFrame> frames_;
+        CallFrame *next_;
+        CallFrame *limit_;
+    };
 }
 
 
@@ -3,149 +3,706 @@
 #include <cassert>
 #include <cstdlib>
 #include <iostream>
+#include <iterator>
 #include <stdexcept>
+#include <utility>
 
 
 #include "gc.h"
 #include "heap.h"
 #include "jit_runtime.h"
+#include "stack_map.h"
 
 namespace {
     interpreter::VMData vm_instance_{};
-    bool jit_on = true;
 }
 
 namespace interpreter {
+    VMData::VMData() = default;
+
+    // out of line, jit::JitRuntime is incomplete in vm.h
+    VMData::~VMData() = default;
+
     VMData &vm_instance() {
         return vm_instance_;
     }
 
-    void run(VMData &vm) {
-        // auto gc = gc::gc();
-
-        while (true) {
-            vm.GC_T++;
-
-            if (vm.GC_T >= GC_CALL_INTERVAL) {
-                vm.GC_T = 0;
-                vm.gc.call();
-            }
-
-            uint32_t instr = vm.code[vm.ip++];
-            OpCode op = static_cast<OpCode>(instr >> OPCODE_SHIFT);
-
-            uint8_t a = (instr >> A_SHIFT) & A_ARG;
-            uint8_t b = (instr >> B_SHIFT) & B_ARG;
-            uint8_t c = instr & C_ARG;
-            uint32_t bx = instr & BX_ARG;
-
-            switch (op) {
-                case OP_LOADINT:
-                    op_load(vm, a, bx);
-                    break;
-                case OP_MOVE:
-                    op_move(vm, a, b);
-                    break;
-                case OP_LOADNIL:
-                    op_loadnil(vm, a);
-                    break;
-                case OP_ADD:
-                    op_add(vm, a, b, c);
-                    break;
-                case OP_SUB:
-                    op_sub(vm, a, b, c);
-                    break;
-                case OP_MUL:
-                    op_mul(vm, a, b, c);
-                    break;
-                case OP_DIV:
-                    op_div(vm, a, b, c);
-                    break;
-                case OP_MOD:
-                    op_mod(vm, a, b, c);
-                    break;
-                case OP_NEG:
-                    op_neg(vm, a, b);
-                    break;
-                case OP_EQ:
-                    op_eq(vm, a, b, c);
-                    break;
-                case OP_NEQ:
-                    op_neq(vm, a, b, c);
-                    break;
-                case OP_LT:
-                    op_lt(vm, a, b, c);
-                    break;
-                case OP_LE:
-                    op_le(vm, a, b, c);
-                    break;
-                case OP_JMP: {
-                    int32_t sbx = static_cast<int32_t>(instr & BX_ARG) - J_ZERO;
-                    op_jmp(vm, sbx);
-                    break;
+    template<bool same = false>
+    inline bool cmp(const Value &v1, const Value &v2) {
+        if (v1.get_class() != v2.get_class()) throw std::runtime_error("Comparison requires same types");
+        if (v1.is_int()) {
+            if constexpr (same) {
+                return v1.i32 <= v2.i32;
+            }
+            return v1.i32 < v2.i32;
+        } else if (v1.is_float()) {
+            if constexpr (same) {
+                return v1.f32 <= v2.f32;
+            }
+            return v1.f32 < v2.f32;
+        } else throw std::runtime_error("Comparison requires compatible types");
+    }
+
+    // Single-branch type guard of the quickened opcodes
+    inline bool both_of_type(const Value &x, const Value &y, uint32_t type) {
+        return ((x.type_part ^ type) | (y.type_part ^ type)) == 0;
+    }
+
+    // Throws if a frame of func at base would not fit into the stack. This stays an explicit compare
+    // instead of relying on the guard page after the stack: a callee may first touch any of its up to
+    // 2^16 registers, which can land past the guard page, the collector scans whole frames, and a
+    // fault cannot be unwound through jitted frames or the signal handler of another VM's thread
+    inline void check_frame(const VMData &vm, uint32_t base, const Function &func) {
+        if (base + func.max_stack > vm.stack_memory.capacity()) [[unlikely]] {
+            throw std::runtime_error("Stack overflow");
+        }
+    }
+
+    // A level of jitted code or of a dispatch loop it started, counted while it is on the native stack
+    struct NativeLevel {
+        explicit NativeLevel(VMData &vm) : vm(vm) { ++vm.native_depth; }
+
+        ~NativeLevel() { --vm.native_depth; }
+
+        NativeLevel(const NativeLevel &) = delete;
+
+        NativeLevel &operator=(const NativeLevel &) = delete;
+
+        VMData &vm;
+    };
+
+    // Whether a call of jitted code has to run in the dispatch loop below it instead of a nested one, past
+    // NATIVE_DEPTH_LIMIT. Points vm.ip at the call, or at its OP_EXTRAARG prefix, for that loop to run it
+    inline bool leave_call(VMData &vm, uint32_t return_ip) {
+        if (vm.native_depth < NATIVE_DEPTH_LIMIT) return false;
+        const bool prefixed = return_ip >= 2 && vm.code[return_ip - 2] >> OPCODE_SHIFT == OP_EXTRAARG;
+        vm.ip = return_ip - (prefixed ? 2 : 1);
+        return true;
+    }
+
+    inline Value int_value(int32_t val) {
+        Value res;
+        res.set_int(val);
+        return res;
+    }
+
+#if defined(__GNUC__) || defined(__clang__)
+#define COTE_COMPUTED_GOTO 1
+#else
+#define COTE_COMPUTED_GOTO 0
+#endif
+
+    // Interpreter loop. ip, frame base and the instruction counter live in locals and are written back
+    // to vm only before calling anything that reads or changes vm state (calls, gc, natives).
+    // threaded == true dispatches through a computed-goto table, otherwise through the switch.
+    // A return that leaves fewer than entry_depth frames on call_stack leaves the loop, so a nested run ends
+    // with the call it was started for, whatever frames were left to it above that call.
+    template<bool threaded>
+    void run_loop(VMData &vm, const size_t entry_depth) {
+        uint32_t *const code = vm.code.data();
+        const Value *const consti = vm.constanti.data();
+        const size_t consti_size = vm.constanti.size();
+        const Value *const constf = vm.constantf.data();
+        const size_t constf_size = vm.constantf.size();
+        const Value *const constk = vm.constantk.data();
+
+        uint32_t ip = vm.ip;
+        Value *R = vm.stack + vm.fp;
+        uint64_t executed = vm.instructions;
+        uint32_t instr, a, b, c, bx;
+
+#define SAVE() (vm.ip = ip, vm.instructions = executed)
+#define RELOAD() (ip = vm.ip, R = vm.stack + vm.fp, executed = vm.instructions)
+// An instruction that may collect points vm.ip at itself, the collector reads the frame's stack map there
+#define SAFEPOINT() (vm.ip = ip - 1, vm.instructions = executed)
+// A taken jump of offset polls the collector when it closes a loop, the frame stops before the target
+#define BACKEDGE(offset)                                                \
+        do {                                                            \
+            if ((offset) < 0 && vm.gc.poll_pending) {                   \
+                SAVE();                                                 \
+                vm.gc.poll();                                           \
+            }                                                           \
+        } while (0)
+#define SBX() (static_cast<int32_t>(bx) - static_cast<int32_t>(J_ZERO))
+#define IMM() (static_cast<int32_t>(c) - static_cast<int32_t>(IMM_ZERO))
+// Fused compare-and-branch: takes the OP_JMP that follows the instruction or skips it
+// Rewrites the executing instruction to another opcode with the same operands
+#define QUICKEN(op) (code[ip - 1] = (instr & ~(~0u << OPCODE_SHIFT)) | (static_cast<uint32_t>(op) << OPCODE_SHIFT))
+#define COND_JUMP(cond)                                                 \
+        do {                                                            \
+            if (cond) {                                                 \
+                const int32_t offset_ = jump_offset(code[ip]) + 1;      \
+                ip += offset_;                                          \
+                BACKEDGE(offset_);                                      \
+            } else {                                                    \
+                ip += 1;                                                \
+            }                                                           \
+        } while (0)
+#define FETCH()                                                         \
+        do {                                                            \
+            ++executed;                                                 \
+            instr = code[ip++];                                         \
+            a = (instr >> A_SHIFT) & A_ARG;                             \
+            b = (instr >> B_SHIFT) & B_ARG;                             \
+            c = instr & C_ARG;                                          \
+            bx = instr & BX_ARG;                                        \
+        } while (0)
+
+#if COTE_COMPUTED_GOTO
+        // Bytecode comes from BytecodeEmitter, so the opcode is trusted to be < OP_COUNT here
+        static void *const handlers[] = {
+            &&L_OP_LOADINT, &&L_OP_MOVE, &&L_OP_LOADNIL, &&L_OP_ADD, &&L_OP_SUB, &&L_OP_MUL,
+            &&L_OP_DIV, &&L_OP_MOD, &&L_OP_NEG, &&L_OP_EQ, &&L_OP_NEQ, &&L_OP_LT, &&L_OP_LE,
+            &&L_OP_JMP, &&L_OP_JMPT, &&L_OP_JMPF, &&L_OP_CALL, &&L_OP_NATIVE_CALL,
+            &&L_OP_INVOKEDYNAMIC, &&L_OP_RETURN, &&L_OP_RETURNNIL, &&L_OP_HALT, &&L_OP_LOADFUNC,
+            &&L_OP_LOADFLOAT, &&L_OP_ALLOC, &&L_OP_ARRGET, &&L_OP_ARRSET, &&L_OP_TAILCALL,
+            &&L_OP_JEQ, &&L_OP_JNE, &&L_OP_JLT, &&L_OP_JLE, &&L_OP_JNLT, &&L_OP_JNLE,
+            &&L_OP_ADDI, &&L_OP_SUBI, &&L_OP_MULI, &&L_OP_ADDK, &&L_OP_SUBK, &&L_OP_MULK, &&L_OP_DIVK,
+            &&L_OP_MODK, &&L_OP_EQI, &&L_OP_LTI, &&L_OP_LEI, &&L_OP_GTI, &&L_OP_GEI,
+            &&L_OP_ADD_II, &&L_OP_ADD_FF, &&L_OP_SUB_II, &&L_OP_SUB_FF, &&L_OP_MUL_II, &&L_OP_MUL_FF,
+            &&L_OP_LT_II, &&L_OP_LE_II, &&L_OP_JLT_II, &&L_OP_JLE_II, &&L_OP_JNLT_II, &&L_OP_JNLE_II,
+            &&L_OP_EXTRAARG,
+        };
+        static_assert(std::size(handlers) == OP_COUNT, "dispatch table is out of sync with OpCode");
+#define TARGET(op) L_##op: case op:
+// only the switch loop jumps to dispatch and execute
+#define SWITCH_LABEL __attribute__((unused))
+// Runs the already decoded instr, without counting it again
+#define EXECUTE()                                                       \
+        do {                                                            \
+            if constexpr (threaded) {                                   \
+                goto *handlers[instr >> OPCODE_SHIFT];                  \
+            } else {                                                    \
+                goto execute;                                           \
+            }                                                           \
+        } while (0)
+#define DISPATCH()                                                      \
+        do {                                                            \
+            if constexpr (threaded) {                                   \
+                FETCH();                                                \
+                goto *handlers[instr >> OPCODE_SHIFT];                  \
+            } else {                                                    \
+                goto dispatch;                                          \
+            }                                                           \
+        } while (0)
+#else
+#define TARGET(op) case op:
+#define SWITCH_LABEL
+#define EXECUTE() goto execute
+#define DISPATCH() goto dispatch
+#endif
+
+        DISPATCH();
+    dispatch: SWITCH_LABEL;
+        FETCH();
+    execute: SWITCH_LABEL;
+        switch (static_cast<OpCode>(instr >> OPCODE_SHIFT)) {
+            TARGET(OP_LOADINT) {
+                if (bx >= consti_size) {
+                    throw std::out_of_range("Constant index out of range");
+                }
+                R[a] = consti[bx];
+                DISPATCH();
+            }
+            TARGET(OP_MOVE) {
+                R[a] = R[b];
+                DISPATCH();
+            }
+            TARGET(OP_LOADNIL) {
+                R[a].set_nil();
+                DISPATCH();
+            }
+            TARGET(OP_ADD) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_ADD_II);
+                    R[a].set_int(x.i32 + y.i32);
+                } else if (x.is_float() && y.is_float()) {
+                    QUICKEN(OP_ADD_FF);
+                    R[a].set_float(x.f32 + y.f32);
+                } else R[a] = add_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_SUB) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_SUB_II);
+                    R[a].set_int(x.i32 - y.i32);
+                } else if (x.is_float() && y.is_float()) {
+                    QUICKEN(OP_SUB_FF);
+                    R[a].set_float(x.f32 - y.f32);
+                } else R[a] = sub_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_MUL) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_MUL_II);
+                    R[a].set_int(x.i32 * y.i32);
+                } else if (x.is_float() && y.is_float()) {
+                    QUICKEN(OP_MUL_FF);
+                    R[a].set_float(x.f32 * y.f32);
+                } else R[a] = mul_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_DIV) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int() && y.i32 != 0) R[a].set_int(x.i32 / y.i32);
+                else R[a] = div_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_MOD) {
+                const Value &x = R[b], &y = R[c];
+                if (!x.is_int() || !y.is_int()) {
+                    throw std::runtime_error("Modulo requires integer operands");
+                }
+                if (y.i32 == 0) {
+                    throw std::runtime_error("Division by zero");
+                }
+                R[a].set_int(x.i32 % y.i32);
+                DISPATCH();
+            }
+            TARGET(OP_NEG) {
+                const Value &x = R[b];
+                if (x.is_int()) R[a].set_int(-x.i32);
+                else if (x.is_float()) R[a].set_float(-x.f32);
+                else throw std::runtime_error("Cannot negate non-numeric value");
+                DISPATCH();
+            }
+            TARGET(OP_EQ) {
+                R[a].set_int(R[b].as_uint64() == R[c].as_uint64());
+                DISPATCH();
+            }
+            TARGET(OP_NEQ) {
+                R[a].set_int(R[b].as_uint64() != R[c].as_uint64());
+                DISPATCH();
+            }
+            TARGET(OP_LT) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_LT_II);
+                    R[a].set_int(x.i32 < y.i32);
+                } else R[a].set_int(cmp<false>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_LE) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_LE_II);
+                    R[a].set_int(x.i32 <= y.i32);
+                } else R[a].set_int(cmp<true>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_JMP) {
+                ip += jump_offset(instr);
+                BACKEDGE(jump_offset(instr));
+                DISPATCH();
+            }
+            TARGET(OP_JMPT) {
+                if (is_truthy(R[a])) {
+                    ip += SBX();
+                    BACKEDGE(SBX());
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JMPF) {
+                if (!is_truthy(R[a])) {
+                    ip += SBX();
+                    BACKEDGE(SBX());
                 }
-                case OP_JMPT: {
-                    int32_t sbx = static_cast<int32_t>(instr & BX_ARG) - J_ZERO;
-                    op_jmpt(vm, a, sbx);
-                    break;
+                DISPATCH();
+            }
+            TARGET(OP_CALL) {
+                SAVE();
+                op_call(vm, a, b, c);
+                RELOAD();
+                DISPATCH();
+            }
+            TARGET(OP_NATIVE_CALL) {
+                SAFEPOINT();
+                vm.natives[a](vm, b, c);
+                DISPATCH();
+            }
+            TARGET(OP_INVOKEDYNAMIC) {
+                SAVE();
+                op_invokedyn(vm, a, b, c);
+                RELOAD();
+                DISPATCH();
+            }
+            TARGET(OP_RETURN) {
+                SAVE();
+                const bool leave = vm.call_stack.size() <= entry_depth;
+                op_return(vm, a);
+                if (leave) return;
+                RELOAD();
+                DISPATCH();
+            }
+            TARGET(OP_RETURNNIL) {
+                SAVE();
+                const bool leave = vm.call_stack.size() <= entry_depth;
+                op_returnnil(vm);
+                if (leave) return;
+                RELOAD();
+                DISPATCH();
+            }
+            TARGET(OP_HALT) {
+                SAVE();
+                op_halt(vm);
+                return;
+            }
+            TARGET(OP_LOADFUNC) {
+                if (bx >= vm.functions.size()) {
+                    throw std::out_of_range("Function constant index out of range");
+                }
+                R[a].set_callable(static_cast<int>(bx));
+                DISPATCH();
+            }
+            TARGET(OP_LOADFLOAT) {
+                if (bx >= constf_size) {
+                    throw std::out_of_range("Float constant index out of range");
                 }
-                case OP_JMPF: {
-                    int32_t sbx = static_cast<int32_t>(instr & BX_ARG) - J_ZERO;
-                    op_jmpf(vm, a, sbx);
-                    break;
+                R[a].set_float(constf[bx].f32);
+                DISPATCH();
+            }
+            TARGET(OP_ALLOC) {
+                SAFEPOINT();
+                op_alloc(vm, a, b);
+                DISPATCH();
+            }
+            TARGET(OP_ARRGET) {
+                SAVE();
+                op_arrget(vm, a, b, c);
+                DISPATCH();
+            }
+            TARGET(OP_ARRSET) {
+                op_arrset(vm, a, b, c);
+                DISPATCH();
+            }
+            TARGET(OP_TAILCALL) {
+                SAVE();
+                op_tailcall(vm, a, b, c);
+                // a tail call loops without growing the stack, the callee stops at its entry
+                if (vm.gc.poll_pending) vm.gc.poll();
+                RELOAD();
+                DISPATCH();
+            }
+            TARGET(OP_JEQ) {
+                COND_JUMP(R[b].as_uint64() == R[c].as_uint64());
+                DISPATCH();
+            }
+            TARGET(OP_JNE) {
+                COND_JUMP(R[b].as_uint64() != R[c].as_uint64());
+                DISPATCH();
+            }
+            TARGET(OP_JLT) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_JLT_II);
+                    COND_JUMP((x.i32 < y.i32));
+                } else COND_JUMP(cmp<false>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_JLE) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_JLE_II);
+                    COND_JUMP((x.i32 <= y.i32));
+                } else COND_JUMP(cmp<true>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_JNLT) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_JNLT_II);
+                    COND_JUMP(!(x.i32 < y.i32));
+                } else COND_JUMP(!cmp<false>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_JNLE) {
+                const Value &x = R[b], &y = R[c];
+                if (x.is_int() && y.is_int()) {
+                    QUICKEN(OP_JNLE_II);
+                    COND_JUMP(!(x.i32 <= y.i32));
+                } else COND_JUMP(!cmp<true>(x, y));
+                DISPATCH();
+            }
+            TARGET(OP_ADDI) {
+                const Value &x = R[b];
+                if (x.is_int()) R[a].set_int(x.i32 + IMM());
+                else R[a] = add_values(x, int_value(IMM()));
+                DISPATCH();
+            }
+            TARGET(OP_SUBI) {
+                const Value &x = R[b];
+                if (x.is_int()) R[a].set_int(x.i32 - IMM());
+                else R[a] = sub_values(x, int_value(IMM()));
+                DISPATCH();
+            }
+            TARGET(OP_MULI) {
+                const Value &x = R[b];
+                if (x.is_int()) R[a].set_int(x.i32 * IMM());
+                else R[a] = mul_values(x, int_value(IMM()));
+                DISPATCH();
+            }
+            TARGET(OP_ADDK) {
+                const Value &x = R[b], &y = constk[c];
+                if (x.is_int() && y.is_int()) R[a].set_int(x.i32 + y.i32);
+                else R[a] = add_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_SUBK) {
+                const Value &x = R[b], &y = constk[c];
+                if (x.is_int() && y.is_int()) R[a].set_int(x.i32 - y.i32);
+                else R[a] = sub_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_MULK) {
+                const Value &x = R[b], &y = constk[c];
+                if (x.is_int() && y.is_int()) R[a].set_int(x.i32 * y.i32);
+                else R[a] = mul_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_DIVK) {
+                const Value &x = R[b], &y = constk[c];
+                if (x.is_int() && y.is_int() && y.i32 != 0) R[a].set_int(x.i32 / y.i32);
+                else R[a] = div_values(x, y);
+                DISPATCH();
+            }
+            TARGET(OP_MODK) {
+                const Value &x = R[b], &y = constk[c];
+                if (!x.is_int() || !y.is_int()) {
+                    throw std::runtime_error("Modulo requires integer operands");
+                }
+                if (y.i32 == 0) {
+                    throw std::runtime_error("Division by zero");
+                }
+                R[a].set_int(x.i32 % y.i32);
+                DISPATCH();
+            }
+            TARGET(OP_EQI) {
+                const Value &x = R[b];
+                COND_JUMP((x.is_int() && x.i32 == IMM()) != (a != 0));
+                DISPATCH();
+            }
+            TARGET(OP_LTI) {
+                const Value &x = R[b];
+                COND_JUMP((x.is_int() ? x.i32 < IMM() : cmp<false>(x, int_value(IMM()))) != (a != 0));
+                DISPATCH();
+            }
+            TARGET(OP_LEI) {
+                const Value &x = R[b];
+                COND_JUMP((x.is_int() ? x.i32 <= IMM() : cmp<true>(x, int_value(IMM()))) != (a != 0));
+                DISPATCH();
+            }
+            TARGET(OP_GTI) {
+                const Value &x = R[b];
+                COND_JUMP((x.is_int() ? x.i32 > IMM() : cmp<false>(int_value(IMM()), x)) != (a != 0));
+                DISPATCH();
+            }
+            TARGET(OP_GEI) {
+                const Value &x = R[b];
+                COND_JUMP((x.is_int() ? x.i32 >= IMM() : cmp<true>(int_value(IMM()), x)) != (a != 0));
+                DISPATCH();
+            }
+            TARGET(OP_ADD_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    R[a].set_int(x.i32 + y.i32);
+                } else {
+                    QUICKEN(OP_ADD);
+                    R[a] = add_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_ADD_FF) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_FLOAT)) [[likely]] {
+                    R[a].set_float(x.f32 + y.f32);
+                } else {
+                    QUICKEN(OP_ADD);
+                    R[a] = add_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_SUB_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    R[a].set_int(x.i32 - y.i32);
+                } else {
+                    QUICKEN(OP_SUB);
+                    R[a] = sub_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_SUB_FF) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_FLOAT)) [[likely]] {
+                    R[a].set_float(x.f32 - y.f32);
+                } else {
+                    QUICKEN(OP_SUB);
+                    R[a] = sub_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_MUL_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    R[a].set_int(x.i32 * y.i32);
+                } else {
+                    QUICKEN(OP_MUL);
+                    R[a] = mul_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_MUL_FF) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_FLOAT)) [[likely]] {
+                    R[a].set_float(x.f32 * y.f32);
+                } else {
+                    QUICKEN(OP_MUL);
+                    R[a] = mul_values(x, y);
+                }
+                DISPATCH();
+            }
+            TARGET(OP_LT_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    R[a].set_int(x.i32 < y.i32);
+                } else {
+                    QUICKEN(OP_LT);
+                    R[a].set_int(cmp<false>(x, y));
                 }
-                case OP_CALL:
-                    op_call(vm, a, b, c);
-                    break;
-                case OP_NATIVE_CALL:
-                    op_native_call(vm, a, b, c);
-                    break;
-                case OP_INVOKEDYNAMIC:
-                    op_invokedyn(vm, a, b, c);
-                    break;
-                case OP_RETURN:
-                    op_return(vm, a);
-                    return;
-                case OP_RETURNNIL:
-                    op_returnnil(vm);
-                    return;
-                case OP_HALT:
-                    op_halt(vm);
-                    return;
-                case OP_LOADFLOAT:
-                    op_loadfloat(vm, a, bx);
-                    break;
-                case OP_LOADFUNC:
-                    op_loadfunc(vm, a, bx);
-                    break;
-                case OP_ALLOC:
-                    op_alloc(vm, a, b);
-                    break;
-                case OP_ARRGET:
-                    op_arrget(vm, a, b, c);
-                    break;
-                case OP_ARRSET:
-                    op_arrset(vm, a, b, c);
-                    break;
-                case OP_TAILCALL:
-                    // op_tailcall(vm, a, b, c);
-                    throw std::runtime_error("Tailcall not implemented");
-                default:
-                    throw std::runtime_error("Unknown opcode");
+                DISPATCH();
             }
+            TARGET(OP_LE_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    R[a].set_int(x.i32 <= y.i32);
+                } else {
+                    QUICKEN(OP_LE);
+                    R[a].set_int(cmp<true>(x, y));
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JLT_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    COND_JUMP((x.i32 < y.i32));
+                } else {
+                    QUICKEN(OP_JLT);
+                    COND_JUMP(cmp<false>(x, y));
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JLE_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    COND_JUMP((x.i32 <= y.i32));
+                } else {
+                    QUICKEN(OP_JLE);
+                    COND_JUMP(cmp<true>(x, y));
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JNLT_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    COND_JUMP(!(x.i32 < y.i32));
+                } else {
+                    QUICKEN(OP_JNLT);
+                    COND_JUMP(!cmp<false>(x, y));
+                }
+                DISPATCH();
+            }
+            TARGET(OP_JNLE_II) {
+                const Value &x = R[b], &y = R[c];
+                if (both_of_type(x, y, TYPE_INT)) [[likely]] {
+                    COND_JUMP(!(x.i32 <= y.i32));
+                } else {
+                    QUICKEN(OP_JNLE);
+                    COND_JUMP(!cmp<true>(x, y));
+                }
+                DISPATCH();
+            }
+            TARGET(OP_EXTRAARG) {
+                const uint32_t ax = instr & AX_ARG;
+                instr = code[ip++];
+                a = wide_a(instr, ax);
+                b = wide_b(instr, ax);
+                c = wide_c(instr, ax);
+                bx = wide_bx(instr, ax);
+                EXECUTE();
+            }
+            default:
+                throw std::runtime_error("Unknown opcode");
         }
+#undef SAVE
+#undef SAFEPOINT
+#undef BACKEDGE
+#undef RELOAD
+#undef SBX
+#undef QUICKEN
+#undef COND_JUMP
+#undef IMM
+#undef FETCH
+#undef TARGET
+#undef SWITCH_LABEL
+#undef DISPATCH
+#undef EXECUTE
+    }
 
-
+    // Roots of the collector: the registers the stack maps of the active frames keep.
+    // The code outside functions only calls main, so its registers hold no references
+    void stack_roots(VMData &vm, std::vector<uint32_t> &out) {
+        uint32_t fp = vm.fp;
+        uint32_t ip = vm.ip;
+        uint32_t limit = UINT32_MAX;
+        for (auto *frame = vm.call_stack.end(); frame != vm.call_stack.begin();) {
+            --frame;
+            append_live_slots(*frame->cur_func, ip, fp, limit, out);
+            // the caller stopped at the call, its registers from the callee's fp on belong to the callee
+            limit = fp - frame->base_ptr;
+            fp = frame->base_ptr;
+            ip = frame->return_ip - 1;
+        }
     }
 
-    void run(bool with_gc) {
+    void dispatch(VMData &vm, const size_t entry_depth) {
+#if COTE_COMPUTED_GOTO
+        if (vm.dispatch_mode == DispatchMode::THREADED) {
+            run_loop<true>(vm, entry_depth);
+        } else
+#endif
+            run_loop<false>(vm, entry_depth);
+    }
 
-        VMData &vm = vm_instance();
+    void run(VMData &vm) {
         vm.gc.init(vm.stack, &vm.call_stack, &vm.fp);
+        vm.gc.stack_roots = [&vm](std::vector<uint32_t> &out) { stack_roots(vm, out); };
+        if (!vm.jitrt) vm.jitrt = std::make_unique<jit::JitRuntime>();
+        dispatch(vm, vm.call_stack.size());
+    }
 
-        vm.jitrt = new jit::JitRuntime();
-        vm.GC_T = 0;
-        run(vm);
+    void reset(VMData &vm) {
+        vm.gc.cleanup();
+        vm.constanti.clear();
+        vm.constantf.clear();
+        vm.constantk.clear();
+        vm.classes.clear();
+        vm.functions.clear();
+        vm.natives.clear();
+        vm.code.clear();
+        vm.call_stack.clear();
+        vm.ip = vm.sp = vm.fp = 0;
+        vm.native_depth = 0;
+        vm.pending = nullptr;
+        vm.instructions = 0;
+        // code of the old functions is never called again
+        vm.jitrt.reset();
+    }
+
+    void run(bool with_gc) {
+        run(vm_instance());
     }
 
     jit::TraceResult run_record() {
@@ -222,7 +779,7 @@ namespace interpreter {
         Value &v1 = vm.stack[vm.fp + src1];
         Value &v2 = vm.stack[vm.fp + src2];
 
-        vm.stack[vm.fp + dst].set_int(v1.as_unmarked() == v2.as_unmarked());
+        vm.stack[vm.fp + dst].set_int(v1.as_uint64() == v2.as_uint64());
     }
 
     void op_neq(VMData &vm, const uint8_t dst, const uint8_t src1, const uint8_t src2) {
@@ -230,22 +787,6 @@ namespace interpreter {
         vm.stack[vm.fp + dst].i32 = 1 - vm.stack[vm.fp + dst].i32;
     }
 
-    template<bool same = false>
-    inline bool cmp(const Value &v1, const Value &v2) {
-        if (v1.get_class() != v2.get_class()) throw std::runtime_error("Comparison requires same types");
-        if (v1.is_int()) {
-            if constexpr (same) {
-                return v1.i32 <= v2.i32;
-            }
-            return v1.i32 < v2.i32;
-        } else if (v1.is_float()) {
-            if constexpr (same) {
-                return v1.f32 <= v2.f32;
-            }
-            return v1.f32 < v2.f32;
-        } else throw std::runtime_error("Comparison requires compatible types");
-    }
-
     void op_lt(VMData &vm, uint8_t dst, uint8_t src1, uint8_t src2) {
         const Value &v1 = vm.stack[vm.fp + src1];
         const Value &v2 = vm.stack[vm.fp + src2];
@@ -258,15 +799,37 @@ namespace interpreter {
         vm.stack[vm.fp + dst].set_int(cmp<true>(v1, v2));
     }
 
+    void deopted(Function &func) {
+        if (++func.deopts % DEOPT_LIMIT == 0) {
+            func.jitted = nullptr;
+            func.hotness = 0;
+            func.banned = func.deopts >= 2 * DEOPT_LIMIT;
+        }
+    }
+
     void invoke_jit(VMData &vm, Function &func) {
-        func.jitted(vm.stack + vm.fp);
+        uint64_t res;
+        {
+            NativeLevel level(vm);
+            res = func.jitted(vm.stack + vm.fp);
+        }
+        if (res == jit::ERR_TYPE) {
+            // a guard failed: the frame is in its slots, the dispatch loop runs it from vm.ip on
+            deopted(func);
+            return;
+        }
+        if (res == jit::ERR_LEAVE) {
+            // a call left the jitted frames to throw or to go on with the innermost frame in the dispatch loop
+            if (vm.pending) std::rethrow_exception(std::exchange(vm.pending, nullptr));
+            return;
+        }
         vm.fp = vm.call_stack.top().base_ptr;
         vm.ip = vm.call_stack.top().return_ip;
         vm.call_stack.pop();
     }
 
-    void op_call(VMData &vm, uint8_t func_idx, uint8_t first_arg_ind, uint8_t num_args) {
-        if (func_idx >= FUNCTIONS_MAX) {
+    void op_call(VMData &vm, uint32_t func_idx, uint32_t first_arg_ind, uint32_t num_args) {
+        if (func_idx >= vm.functions.size()) {
             throw std::out_of_range("Function index out of range");
         }
 
@@ -275,27 +838,119 @@ namespace interpreter {
             throw std::runtime_error("Argument count mismatch");
         }
 
-        if (vm.call_stack.size() >= CALL_MAX_SIZE) {
-            throw std::runtime_error("Call stack overflow");
-        }
+        check_frame(vm, vm.fp + first_arg_ind, func);
         vm.call_stack.push(CallFrame{vm.ip, vm.fp, &func});
 
         vm.fp = vm.fp + first_arg_ind;
+        enter_function(vm, func, num_args);
+    }
+
+    bool call_from_jit(VMData &vm, uint32_t func_idx, uint32_t first_arg_ind, uint32_t num_args,
+                       uint32_t return_ip) {
+        if (leave_call(vm, return_ip)) return true;
+        try {
+            const size_t depth = vm.call_stack.size();
+            vm.ip = return_ip;
+            op_call(vm, func_idx, first_arg_ind, num_args);
+            // an interpreted callee, or one whose code deopted or left a call, is still on the stack
+            if (vm.call_stack.size() > depth) {
+                NativeLevel level(vm);
+                dispatch(vm, depth + 1);
+            }
+        } catch (...) {
+            // it cannot unwind the jitted frames, invoke_jit throws it past them
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    bool invoke_from_jit(VMData &vm, jit::CallCache *cache, uint32_t a, uint32_t first_arg_ind,
+                         uint32_t num_args, uint32_t return_ip) {
+        if (leave_call(vm, return_ip)) return true;
+        try {
+            const Value callable = vm.stack[vm.fp + a];
+            // the first callee of the site stays the one it calls directly
+            if (cache->callable == 0 && callable.is_callable() &&
+                static_cast<uint32_t>(callable.i32) < vm.functions.size()) {
+                const Function &callee = vm.functions[callable.i32];
+                if (callee.arity == num_args && callee.max_stack <= vm.stack_memory.capacity()) {
+                    cache->fill(vm, callable.i32);
+                }
+            }
+            const size_t depth = vm.call_stack.size();
+            vm.ip = return_ip;
+            op_invokedyn(vm, a, first_arg_ind, num_args);
+            if (vm.call_stack.size() > depth) {
+                NativeLevel level(vm);
+                dispatch(vm, depth + 1);
+            }
+        } catch (...) {
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    bool resume_deopted(VMData &vm) {
+        deopted(*vm.call_stack.top().cur_func);
+        if (vm.native_depth >= NATIVE_DEPTH_LIMIT) return true;
+        try {
+            NativeLevel level(vm);
+            dispatch(vm, vm.call_stack.size());
+        } catch (...) {
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    bool native_from_jit(VMData &vm, NativeFunction native, int reg, int cnt) noexcept {
+        try {
+            native(vm, reg, cnt);
+        } catch (...) {
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    bool arrget_from_jit(VMData &vm, uint32_t dst, uint32_t arr, uint32_t idx) noexcept {
+        try {
+            op_arrget(vm, dst, arr, idx);
+        } catch (...) {
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    bool arrset_from_jit(VMData &vm, uint32_t arr, uint32_t idx, uint32_t src) noexcept {
+        try {
+            op_arrset(vm, arr, idx, src);
+        } catch (...) {
+            vm.pending = std::current_exception();
+            return true;
+        }
+        return false;
+    }
+
+    // Starts func in the frame on top of call_stack whose first num_args registers hold the arguments
+    void enter_function(VMData &vm, Function &func, uint32_t num_args) {
+        // the registers past the arguments keep stale values, the stack maps leave them out until written
         vm.ip = func.entry_point;
-        const uint32_t sp = vm.gc.get_sp();
-        for (int i = vm.fp + (uint32_t) num_args; i < sp; ++i) {
-            vm.stack[i].set_nil();
+        if (func.stack_map.empty()) {
+            // hand-written code has no map and its frame is scanned whole, so nothing stale may stay there
+            for (uint32_t r = num_args; r < func.max_stack; ++r) vm.stack[vm.fp + r].set_nil();
         }
+        // past the limit the dispatch loop runs the callee, it does not grow the native stack per call
+        const bool native = vm.native_depth < NATIVE_DEPTH_LIMIT;
         if (func.jitted != nullptr) {
-            invoke_jit(vm, func);
+            if (native) invoke_jit(vm, func);
             return;
         }
         func.hotness += 1;
-        if (is_jit_on() && func.hotness >= HOT_THRESHOLD) {
-            if (func.banned) {
-                run(vm);
-                return;
-            }
+        if (vm.jit_on && func.hotness >= HOT_THRESHOLD && !func.banned) {
             if (vm.jit_log_level > 0) {
                 std::cerr << "Hot function at: " << func.entry_point << std::endl;
             }
@@ -305,14 +960,39 @@ namespace interpreter {
                 if (vm.jit_log_level > 0) std::cerr << "Discard hot at: " << func.entry_point << std::endl;
             } else {
                 if (vm.jit_log_level > 0) std::cerr << "Compiled hot at: " << func.entry_point << std::endl;
-                invoke_jit(vm, func);
+                if (native) invoke_jit(vm, func);
                 return;
             }
         }
-        run(vm);
+        // interpreted: the dispatch loop continues at func.entry_point
+    }
+
+    void op_tailcall(VMData &vm, uint32_t a, uint32_t first_arg_ind, uint32_t num_args) {
+        const Value callable = vm.stack[vm.fp + a];
+        if (!callable.is_callable()) {
+            throw std::runtime_error("No expected callable");
+        }
+        if (static_cast<uint32_t>(callable.i32) >= vm.functions.size()) {
+            throw std::out_of_range("Function index out of range");
+        }
+        Function &func = vm.functions[callable.i32];
+        if (num_args != func.arity) {
+            throw std::runtime_error("Argument count mismatch");
+        }
+        if (vm.call_stack.empty()) {
+            throw std::runtime_error("Tail call outside of function");
+        }
+        check_frame(vm, vm.fp, func);
+        // the callee takes over the current frame, so it returns straight to our caller
+        Value *frame = vm.stack + vm.fp;
+        for (uint32_t i = 0; i < num_args; ++i) {
+            frame[i] = frame[first_arg_ind + i];
+        }
+        vm.call_stack.top().cur_func = &func;
+        enter_function(vm, func, num_args);
     }
 
-    void op_return(VMData &vm, uint8_t result_reg) {
+    void op_return(VMData &vm, uint32_t result_reg) {
         if (vm.call_stack.empty()) {
             op_halt(vm);
             return;
@@ -394,7 +1074,7 @@ namespace interpreter {
     }
 
     void op_halt(VMData &vm) {
-        vm.ip = CODE_MAX_SIZE - 1; // Stop execution
+        vm.ip = vm.code.size() - 1; // Stop execution
     }
 
     Value add_values(const Value &a, const Value &b) {
@@ -460,11 +1140,11 @@ namespace interpreter {
         return res;
     }
 
-    void op_native_call(VMData &vm, uint8_t func_idx, int reg, int count) {
+    void op_native_call(VMData &vm, uint32_t func_idx, int reg, int count) {
         vm.natives[func_idx](vm, reg, count);
     }
 
-    void op_invokedyn(VMData &vm, uint8_t a, uint8_t b, uint8_t c) {
+    void op_invokedyn(VMData &vm, uint32_t a, uint32_t b, uint32_t c) {
         Value callable = vm.stack[vm.fp + a];
         if (!callable.is_callable()) {
             throw std::runtime_error("No expected callable");
@@ -489,13 +1169,13 @@ namespace interpreter {
     }
 
     void op_loadfunc(VMData &vm, uint8_t reg, uint32_t const_idx) {
-        if (const_idx >= vm.functions_count) {
+        if (const_idx >= vm.functions.size()) {
             throw std::out_of_range("Function constant index out of range");
         }
         vm.stack[vm.fp + reg].set_callable(static_cast<int>(const_idx));
     }
 
-    void op_alloc(VMData &vm, uint8_t dst, uint8_t s) {
+    void op_alloc(VMData &vm, uint32_t dst, uint32_t s) {
         const uint32_t size = vm.stack[vm.fp + s].i32;
 
         auto *fields = vm.gc.alloc_array(size);
@@ -504,10 +1184,10 @@ namespace interpreter {
             throw std::runtime_error("Memory allocation failed");
         }
 
-        vm.stack[vm.fp + dst].set_array</*mark for gc=*/false>(size, fields); // Array class is always at index 1
+        vm.stack[vm.fp + dst].set_array(size, fields); // Array class is always at index 1
     }
 
-    void op_arrget(VMData &vm, uint8_t dst, uint8_t arr, uint8_t idxc) {
+    void op_arrget(VMData &vm, uint32_t dst, uint32_t arr, uint32_t idxc) {
         auto &idx = vm.stack[vm.fp + idxc];
         if (!idx.is_int()) {
             throw std::runtime_error("Invalid array index");
@@ -517,7 +1197,7 @@ namespace interpreter {
             throw std::runtime_error("Expected array object while arrayget");
         }
 
-        auto *obj = heap::mem.at(arr_val.object_ptr);
+        auto *obj = vm.gc.resolve(arr_val.object_ptr);
 
         assert(obj->is_array());
 
@@ -527,18 +1207,11 @@ namespace interpreter {
             throw std::out_of_range("Array index out of bounds, ip: " + std::to_string(vm.ip));
         }
 
-        if (obj[idx.i32 + 1].is_array()) {
-            auto *ptr = heap::mem.at(obj[idx.i32 + 1].object_ptr);
-            // update obj[i]
-            obj[idx.i32 + 1] = *ptr;
-            vm.stack[vm.fp + dst] = *ptr;
-
-        } else {
-            vm.stack[vm.fp + dst] = obj[idx.i32 + 1];
-        }
+        // the gc keeps references in the heap up to date, an array element is copied as is
+        vm.stack[vm.fp + dst] = obj[idx.i32 + 1];
     }
 
-    void op_arrset(VMData &vm, uint8_t arr, uint8_t idxc, uint8_t src) {
+    void op_arrset(VMData &vm, uint32_t arr, uint32_t idxc, uint32_t src) {
         Value &arr_val = vm.stack[vm.fp + arr];
         auto &idx = vm.stack[vm.fp + idxc];
         if (!idx.is_int()) {
@@ -549,7 +1222,7 @@ namespace interpreter {
             throw std::runtime_error("Expected array object while arrayset");
         }
 
-        auto *obj = heap::mem.at(arr_val.object_ptr);
+        auto *obj = vm.gc.resolve(arr_val.object_ptr);
 
         const uint32_t len = obj->get_len();
         if (idx.i32 >= len) {
@@ -557,6 +1230,7 @@ namespace interpreter {
         }
 
         obj[idx.i32 + 1] = vm.stack[vm.fp + src];
+        vm.gc.write_barrier(arr_val.object_ptr + idx.i32 + 1, obj[idx.i32 + 1]);
     }
 
 
@@ -573,14 +1247,22 @@ namespace interpreter {
         return (static_cast<int>(code) << OPCODE_SHIFT) | (a << A_SHIFT) | bx;
     }
 
-    uint32_t opcode(OpCode code, uint8_t a, uint8_t b, uint8_t c) {
-        return (static_cast<int>(code) << OPCODE_SHIFT) | (a << A_SHIFT) | (b << B_SHIFT) | c;
+    uint32_t opcode(OpCode code, uint8_t a, uint16_t b, uint16_t c) {
+        return (static_cast<int>(code) << OPCODE_SHIFT) | (a << A_SHIFT) | ((b & B_ARG) << B_SHIFT) | (c & C_ARG);
     }
 
     uint32_t halt() {
         return (static_cast<int>(OP_HALT) << OPCODE_SHIFT);
     }
 
+    uint32_t jmp(int32_t offset) {
+        return (static_cast<uint32_t>(OP_JMP) << OPCODE_SHIFT) | ((offset + static_cast<int32_t>(SJ_ZERO)) & AX_ARG);
+    }
+
+    uint32_t extraarg(uint32_t ax) {
+        return (static_cast<uint32_t>(OP_EXTRAARG) << OPCODE_SHIFT) | (ax & AX_ARG);
+    }
+
 
     void op_jmp(VMData &vm, int32_t offset) {
         vm.ip += offset;
@@ -610,6 +1292,34 @@ namespace interpreter {
         return (static_cast<int>(code) << OPCODE_SHIFT);
     }
 
+    OpCode unquickened(OpCode code) {
+        switch (code) {
+            case OP_ADD_II:
+            case OP_ADD_FF:
+                return OP_ADD;
+            case OP_SUB_II:
+            case OP_SUB_FF:
+                return OP_SUB;
+            case OP_MUL_II:
+            case OP_MUL_FF:
+                return OP_MUL;
+            case OP_LT_II:
+                return OP_LT;
+            case OP_LE_II:
+                return OP_LE;
+            case OP_JLT_II:
+                return OP_JLT;
+            case OP_JLE_II:
+                return OP_JLE;
+            case OP_JNLT_II:
+                return OP_JNLT;
+            case OP_JNLE_II:
+                return OP_JNLE;
+            default:
+                return code;
+        }
+    }
+
     void print_opcode(uint32_t instruction) {
         // Extract arguments from instruction
         uint8_t opcode = instruction >> OPCODE_SHIFT;
@@ -687,15 +1397,23 @@ namespace interpreter {
     }
 
     bool is_jit_on() {
-        return jit_on;
+        return vm_instance().jit_on;
     }
 
     void set_jit_on() {
-        jit_on = true;
+        vm_instance().jit_on = true;
     }
 
     void set_jit_off() {
-        jit_on = false;
+        vm_instance().jit_on = false;
+    }
+
+    DispatchMode get_dispatch_mode() {
+        return vm_instance().dispatch_mode;
+    }
+
+    void set_dispatch_mode(DispatchMode mode) {
+        vm_instance().dispatch_mode = mode;
     }
 
     void init_vm(std::istream &in) {
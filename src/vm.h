@@ -2,12 +2,15 @@
 #define CRYPT_VM_H
 
 #include <cstdint>
+#include <exception>
 #include <fstream>
-#include <stack>
+#include <memory>
+#include <memory_resource>
 #include <unordered_map>
 #include <vector>
 
 #include "heap.h"
+#include "stack_memory.h"
 #include "value.h"
 
 #define DEFAULT_GC_YOUNG_CAPACITY 21
@@ -17,6 +20,7 @@ namespace jit {
     struct TraceEntry;
     enum class TraceResult;
     struct JitRuntime;
+    struct CallCache;
 }
 
 namespace interpreter {
@@ -91,8 +95,8 @@ namespace interpreter {
         OP_LE,
 
         // Unconditional jump
-        // Args: sbx - signed offset
-        // Behavior: ip += sbx
+        // Args: sj - signed offset in the 26 bits of a and bx, biased by SJ_ZERO
+        // Behavior: ip += sj
         OP_JMP,
 
         // Jump if true
@@ -156,10 +160,109 @@ namespace interpreter {
         OP_ALLOC,
         OP_ARRGET,//TODO
         OP_ARRSET,//TODO
+
+        // Call in tail position (return f(...)), reuses the current frame
+        // Args: Same as OP_INVOKEDYNAMIC
+        // Behavior:
+        //   1. Moves the arguments to registers[0..c)
+        //   2. Jumps to the entry point of functions[register[a]], no frame is pushed,
+        //      the callee returns to the caller of the current function
         OP_TAILCALL,
+
+        // Fused compare-and-branch, always followed by the OP_JMP that holds the offset
+        // Args: b - first operand, c - second operand
+        // Behavior: if (registers[b] == registers[c]) the next OP_JMP is taken, otherwise skipped
+        OP_JEQ,
+
+        // Same as OP_JEQ for registers[b] != registers[c]
+        OP_JNE,
+
+        // Same as OP_JEQ for registers[b] < registers[c]
+        OP_JLT,
+
+        // Same as OP_JEQ for registers[b] <= registers[c]
+        OP_JLE,
+
+        // Same as OP_JEQ for !(registers[b] < registers[c])
+        OP_JNLT,
+
+        // Same as OP_JEQ for !(registers[b] <= registers[c])
+        OP_JNLE,
+
+        // Arithmetic with an immediate operand
+        // Args: a - destination, b - source register, c - signed immediate biased by IMM_ZERO
+        // Behavior: registers[a] = registers[b] + imm
+        OP_ADDI,
+
+        // Same as OP_ADDI, registers[a] = registers[b] - imm
+        OP_SUBI,
+
+        // Same as OP_ADDI, registers[a] = registers[b] * imm
+        OP_MULI,
+
+        // Arithmetic with a constant operand
+        // Args: a - destination, b - source register, c - index in constantk
+        // Behavior: registers[a] = registers[b] + constantk[c]
+        OP_ADDK,
+
+        // Same as OP_ADDK, registers[a] = registers[b] - constantk[c]
+        OP_SUBK,
+
+        // Same as OP_ADDK, registers[a] = registers[b] * constantk[c]
+        OP_MULK,
+
+        // Same as OP_ADDK, registers[a] = registers[b] / constantk[c]
+        OP_DIVK,
+
+        // Same as OP_ADDK, registers[a] = registers[b] % constantk[c]
+        OP_MODK,
+
+        // Fused compare-with-immediate and branch, always followed by the OP_JMP that holds the offset
+        // Args: a - negate flag, b - compared register, c - signed immediate biased by IMM_ZERO
+        // Behavior: if ((registers[b] == imm) != a) the next OP_JMP is taken, otherwise skipped
+        OP_EQI,
+
+        // Same as OP_EQI for registers[b] < imm
+        OP_LTI,
+
+        // Same as OP_EQI for registers[b] <= imm
+        OP_LEI,
+
+        // Same as OP_EQI for registers[b] > imm
+        OP_GTI,
+
+        // Same as OP_EQI for registers[b] >= imm
+        OP_GEI,
+
+        // Type-quickened forms. The interpreter rewrites the generic instruction in place once it sees
+        // the operand types; on a type guard failure the instruction is rewritten back to the generic one
+        // Args: Same as the generic opcode
+        OP_ADD_II, // OP_ADD, int operands
+        OP_ADD_FF, // OP_ADD, float operands
+        OP_SUB_II,
+        OP_SUB_FF,
+        OP_MUL_II,
+        OP_MUL_FF,
+        OP_LT_II,
+        OP_LE_II,
+        OP_JLT_II,
+        OP_JLE_II,
+        OP_JNLT_II,
+        OP_JNLE_II,
+
+        // Prefix that widens the operands of the instruction right after it, emitted only when they
+        // do not fit into the compact fields
+        // Args: ax - 26 bits, bits 0..7 extend a, bits 8..16 extend b, bits 17..25 extend c,
+        //       bits 8..25 extend bx (a wide sbx is stored as the 32-bit value offset + J_ZERO)
+        // Behavior: executes the next instruction with the widened operands, see wide_a/wide_b/wide_c/wide_bx
+        OP_EXTRAARG,
+
+        // Number of opcodes, not an instruction
+        OP_COUNT,
     };
 
 
+    // Takes cnt arguments from register reg on and always writes its result to register reg
     typedef void (*NativeFunction)(VMData &, int reg, int cnt);
 
     struct ObjClass {
@@ -167,11 +270,11 @@ namespace interpreter {
     };
 
 // Memory limits
-    static constexpr uint32_t CODE_MAX_SIZE = 4096;
-    static constexpr uint32_t STACK_SIZE = 4096;
+    // Values of address space reserved for the stack (64 MiB), only touched pages use memory
+    static constexpr uint32_t STACK_RESERVE = 1u << 23;
     static constexpr uint32_t HEAP_MAX_SIZE = 65536;
-    static constexpr uint32_t FUNCTIONS_MAX = 256;
-    static constexpr uint32_t CALL_MAX_SIZE = 2000;
+    // initial capacity of call_stack, it grows on demand
+    static constexpr uint32_t CALL_STACK_INITIAL = 256;
 
 // Dispatch constants
     static constexpr uint32_t A_ARG = 0xFF;
@@ -184,28 +287,79 @@ namespace interpreter {
     static constexpr uint32_t C_SHIFT = 0;
     static constexpr uint32_t SBX_SHIFT = 0;
     static constexpr uint32_t J_ZERO = BX_ARG >> 1;
+    // OP_JMP and OP_EXTRAARG use all bits below the opcode as one field
+    static constexpr uint32_t AX_ARG = (1u << OPCODE_SHIFT) - 1;
+    static constexpr uint32_t SJ_ZERO = AX_ARG >> 1;
+    // Immediates in the c field are stored biased by IMM_ZERO
+    static constexpr uint32_t IMM_ZERO = C_ARG >> 1;
+    static constexpr int32_t IMM_MIN = -static_cast<int32_t>(IMM_ZERO);
+    static constexpr int32_t IMM_MAX = static_cast<int32_t>(C_ARG - IMM_ZERO);
+    static_assert(OP_COUNT <= (1u << (32 - OPCODE_SHIFT)), "opcode does not fit into instruction");
+
+    // Operands of instr widened by the ax of the OP_EXTRAARG before it, ax == 0 if there is no prefix
+    inline uint32_t wide_a(uint32_t instr, uint32_t ax) {
+        return ((instr >> A_SHIFT) & A_ARG) | ((ax & A_ARG) << 8);
+    }
+
+    inline uint32_t wide_b(uint32_t instr, uint32_t ax) {
+        return ((instr >> B_SHIFT) & B_ARG) | (((ax >> 8) & B_ARG) << 9);
+    }
+
+    inline uint32_t wide_c(uint32_t instr, uint32_t ax) {
+        return (instr & C_ARG) | (((ax >> 17) & C_ARG) << 9);
+    }
+
+    inline uint32_t wide_bx(uint32_t instr, uint32_t ax) {
+        return (instr & BX_ARG) | ((ax >> 8) << 18);
+    }
+
+    // Signed offset of an OP_JMP
+    inline int32_t jump_offset(uint32_t instr) {
+        return static_cast<int32_t>(instr & AX_ARG) - static_cast<int32_t>(SJ_ZERO);
+    }
 
     static constexpr int HOT_THRESHOLD = 10;
-    static constexpr int GC_CALL_INTERVAL = 2000;
+    // After this many deopts the code of a function is dropped and it warms up again, the next code does
+    // not speculate on the profile. A function that keeps deopting after that stays interpreted
+    static constexpr uint32_t DEOPT_LIMIT = 8;
+    // Jitted code and the dispatch loops it starts nest on the native stack. Past this many levels calls run
+    // in the dispatch loop below them instead, so the call depth is bounded by the VM stack alone
+    static constexpr uint32_t NATIVE_DEPTH_LIMIT = 256;
+
+    // How run() dispatches bytecode
+    enum class DispatchMode {
+        SWITCH, // portable switch over the opcode
+        THREADED, // computed goto, same as SWITCH on compilers without labels as values
+    };
 
+    // One independent VM: it owns its stack, heap, JIT runtime and natives, so separate instances
+    // can run on separate threads. An instance itself must be used by one thread at a time
     // template<uint16_t GC_YOUNG_THRESHOLD=50>
     struct VMData {
+        VMData();
+
+        ~VMData();
+
+        VMData(const VMData &) = delete;
+
+        VMData &operator=(const VMData &) = delete;
+
 #ifndef DEFAULT_GC_YOUNG_CAPACITY
         heap::GarbageCollector<200> gc{};
 #else
         heap::GarbageCollector<DEFAULT_GC_YOUNG_CAPACITY> gc{};
 #endif
-        int GC_T = 0;
+        // instructions dispatched by the interpreter (not by jitted code) over all runs since reset()
+        uint64_t instructions = 0;
 
         //  Static data: must be filled before running vm
         std::vector<Value> constanti;
         std::vector<Value> constantf;
+        // operands of OP_ADDK..OP_MODK, ints and floats
+        std::vector<Value> constantk;
         std::vector<ObjClass> classes;
-        Function functions[FUNCTIONS_MAX];
-        NativeFunction natives[FUNCTIONS_MAX];
-        // -- general info --
-        size_t code_size = 0;
-        size_t functions_count = 0;
+        std::vector<Function> functions;
+        std::vector<NativeFunction> natives;
 
         // Heap storage
 
@@ -215,27 +369,49 @@ namespace interpreter {
         // uint32_t heap_size = 0;
 
         // Execution state
-        Value stack[STACK_SIZE];
-        uint32_t code[CODE_MAX_SIZE];
+        StackMemory stack_memory{STACK_RESERVE};
+        Value *const stack = stack_memory.data();
+        // must not be resized while running, the dispatch loop and frames point into it
+        std::vector<uint32_t> code;
 
         uint32_t ip = 0;  // Instruction pointer
         uint32_t sp = 0;  // Stack pointer
         uint32_t fp = 0;  // Frame pointer
-        std::stack<CallFrame> call_stack;
-        jit::JitRuntime *jitrt;
+        CallStack call_stack{CALL_STACK_INITIAL};
+        // levels of jitted code and of dispatch loops started by it on the native stack, see NATIVE_DEPTH_LIMIT
+        uint32_t native_depth = 0;
+        // thrown below jitted code, which left to the interpreter to throw it again, see call_from_jit
+        std::exception_ptr pending;
+        // created by the first run()
+        std::unique_ptr<jit::JitRuntime> jitrt;
         int jit_log_level = 0;
+        bool jit_on = true;
+        DispatchMode dispatch_mode = DispatchMode::THREADED;
 
     };
 
+    // The flags below are the ones of vm_instance()
     bool is_jit_on();
 
     void set_jit_on();
 
     void set_jit_off();
 
+    DispatchMode get_dispatch_mode();
+
+    void set_dispatch_mode(DispatchMode mode);
+
 // Core VM functions
+    // Runs vm from vm.ip until its code halts
+    void run(VMData &vm);
+
+    // Runs vm_instance()
     void run(bool with_gc = true);
 
+    // Drops the program, heap and jitted code of vm, keeping its allocated stack and arenas for the next one
+    void reset(VMData &vm);
+
+    // The default instance, used by the functions that do not take a VMData
     VMData &vm_instance();
 
 // Helper functions (creating opcode)
@@ -245,7 +421,7 @@ namespace interpreter {
 
 // For: OP_MOVE(!better use move() to not mistake), OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
 //                OP_EQ, OP_LT, OP_LE, OP_GETFIELD, OP_SETFIELD
-    uint32_t opcode(OpCode code, uint8_t a, uint8_t b, uint8_t c);
+    uint32_t opcode(OpCode code, uint8_t a, uint16_t b, uint16_t c);
 
 // For: OP_RETURN
 //      OP_LOADNIL
@@ -255,6 +431,15 @@ namespace interpreter {
 // For: OP_RETURNNIL, OP_HALT
     uint32_t opcode(OpCode code);
 
+// For: OP_JMP, offset must be in [-SJ_ZERO, SJ_ZERO + 1]
+    uint32_t jmp(int32_t offset);
+
+// For: OP_EXTRAARG
+    uint32_t extraarg(uint32_t ax);
+
+// Generic opcode of a type-quickened one (OP_ADD for OP_ADD_II), other opcodes are returned as is
+    OpCode unquickened(OpCode code);
+
     uint32_t halt();
 
     uint32_t move(uint8_t a, uint8_t b);
@@ -287,13 +472,12 @@ namespace interpreter {
 
     void op_loadfunc(VMData &vm, uint8_t reg, uint32_t const_idx);
 
-    void op_alloc(VMData &vm, uint8_t dst, uint8_t size);
+    void op_alloc(VMData &vm, uint32_t dst, uint32_t size);
 
-    void op_arrget(VMData &vm, uint8_t dst, uint8_t arr, uint8_t idx);
+    void op_arrget(VMData &vm, uint32_t dst, uint32_t arr, uint32_t idx);
 
-    void op_arrset(VMData &vm, uint8_t arr, uint8_t idx, uint8_t src);
+    void op_arrset(VMData &vm, uint32_t arr, uint32_t idx, uint32_t src);
 
-// void op_tailcall(VMData &vm, uint8_t func_idx, uint8_t first_arg_ind, uint8_t num_args);
     void op_add(VMData &vm, uint8_t dst, uint8_t src1, uint8_t src2);
 
     void op_sub(VMData &vm, uint8_t dst, uint8_t src1, uint8_t src2);
@@ -314,13 +498,45 @@ namespace interpreter {
 
     void op_le(VMData &vm, uint8_t dst, uint8_t src1, uint8_t src2);
 
-    void op_call(VMData &vm, uint8_t func_idx, uint8_t first_arg_ind, uint8_t num_args);
+    // Pushes the frame and sets ip/fp to the callee, which the dispatch loop continues with;
+    // a jitted callee is run to completion and its frame is popped right away, unless its code deopts
+    void op_call(VMData &vm, uint32_t func_idx, uint32_t first_arg_ind, uint32_t num_args);
+
+    void op_native_call(VMData &vm, uint32_t func_idx, int reg1, int count);
+
+    void op_invokedyn(VMData &vm, uint32_t a, uint32_t b, uint32_t c);
+
+    // Replaces the function of the frame on top of call_stack with the callee, see OP_TAILCALL
+    void op_tailcall(VMData &vm, uint32_t a, uint32_t first_arg_ind, uint32_t num_args);
+
+    void enter_function(VMData &vm, Function &func, uint32_t num_args);
+
+    // OP_CALL of jitted code whose callee has no code or no room for its frame: op_call, then the callee
+    // runs in the interpreter until it returns. return_ip is the instruction after the call.
+    // Returns true when the jitted caller has to return jit::ERR_LEAVE: past NATIVE_DEPTH_LIMIT, having done
+    // nothing but point vm.ip at the call, which the dispatch loop below runs then, and when the call threw,
+    // with the exception in vm.pending
+    bool call_from_jit(VMData &vm, uint32_t func_idx, uint32_t first_arg_ind, uint32_t num_args,
+                       uint32_t return_ip);
+
+    // OP_INVOKEDYNAMIC of jitted code whose cache holds another callee or one it cannot call directly: fills
+    // the cache if it is empty and the callee can be called directly, then the call of call_from_jit
+    bool invoke_from_jit(VMData &vm, jit::CallCache *cache, uint32_t a, uint32_t first_arg_ind,
+                         uint32_t num_args, uint32_t return_ip);
+
+    // The code of the frame on top of call_stack, called by jitted code, deopted at vm.ip: runs the frame
+    // in the interpreter until it returns. Returns true as call_from_jit does
+    bool resume_deopted(VMData &vm);
+
+    // A native, op_arrget and op_arrset called by jitted code, which an exception cannot unwind: return true,
+    // with the exception in vm.pending, when the call threw, and the jitted caller returns jit::ERR_LEAVE
+    bool native_from_jit(VMData &vm, NativeFunction native, int reg, int cnt) noexcept;
 
-    void op_native_call(VMData &vm, uint8_t func_idx, int reg1, int count);
+    bool arrget_from_jit(VMData &vm, uint32_t dst, uint32_t arr, uint32_t idx) noexcept;
 
-    void op_invokedyn(VMData &vm, uint8_t a, uint8_t b, uint8_t c);
+    bool arrset_from_jit(VMData &vm, uint32_t arr, uint32_t idx, uint32_t src) noexcept;
 
-    void op_return(VMData &vm, uint8_t result_reg);
+    void op_return(VMData &vm, uint32_t result_reg);
 
     void op_returnnil(VMData &vm);
 
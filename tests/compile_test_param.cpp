@@ -7,6 +7,9 @@
 #include "utils.h"
 #include "src/ast.h"
 #include "src/ins_to_string.h"
+#include <atomic>
+#include <sstream>
+#include <thread>
 
 using namespace interpreter;
 using SimpleCompileFromFileOk = Test;
@@ -17,8 +20,8 @@ inline void compile_program(std::istream &fin, const std::string &file_name = "c
     auto &vm = initVM();
     vm.gc.cleanup();
 #ifdef DEFAULT_GC_YOUNG_CAPACITY
-    vm.gc.MAJOR_THRESHOLD = 10;
-    vm.gc.LARGE_THRESHOLD = 10;
+    vm.gc.MAJOR_MIN_BUDGET = 64;
+    vm.gc.LARGE_MIN_BUDGET = 256;
 #endif
     parser::init_parser(fin, new BytecodeEmitter());
     ASSERT_NO_THROW(parser::parse_program(vm));
@@ -60,6 +63,166 @@ TEST(SimpleCompileFromFileOk, NoAlloc) {
 
 }
 
+TEST(SimpleCompileFromFileOk, TestCondJumps) {
+    ASSERT_NO_THROW({
+                        std::ifstream fin("../../tests/sources/test_cond_jumps.ct");
+                        return compile_program(fin);
+                    });
+}
+
+TEST(SimpleCompileFromFileOk, TestLiteralOps) {
+    ASSERT_NO_THROW({
+                        std::ifstream fin("../../tests/sources/test_literal_ops.ct");
+                        return compile_program(fin);
+                    });
+}
+
+TEST(SimpleCompileFromFileOk, TestQuickening) {
+    ASSERT_NO_THROW({
+                        std::ifstream fin("../../tests/sources/test_quickening.ct");
+                        return compile_program(fin);
+                    });
+}
+
+TEST(SimpleCompileFromFileOk, TestDeepRecursion) {
+    ASSERT_NO_THROW({
+                        std::ifstream fin("../../tests/sources/test_deep_recursion.ct");
+                        return compile_program(fin);
+                    });
+}
+
+TEST(SimpleCompileFromFileOk, TestTailCalls) {
+    ASSERT_NO_THROW({
+                        std::ifstream fin("../../tests/sources/test_tail_calls.ct");
+                        return compile_program(fin);
+                    });
+}
+
+TEST(SimpleCompileFromFileOk, TestLargeProgram) {
+    // more functions, code and call depth than the old fixed VM tables allowed
+    std::stringstream src;
+    for (int i = 0; i < 1200; ++i) {
+        src << "fn f" << i << "(x) { y = x * 2; return y - x + " << i << "; }\n";
+    }
+    src << "fn depth(n) { if (n == 0) return 0; return depth(n - 1) + 1; }\n";
+    src << "fn main() { if (depth(100000) != 100000) throw(); return f1199(1) - 1200; }\n";
+    ASSERT_NO_THROW(compile_program(src));
+}
+
+TEST(SimpleCompileFromFileOk, TestWideEncoding) {
+    // jumps over more than bx can hold, more than 256 registers and more than 2^18 constants
+    std::stringstream src;
+    src << "fn big(n) { s = 0; i = 0; while (i < n) { if (n) {\n";
+    for (int i = 0; i < 70000; ++i) {
+        src << "s = s + 1;\n";
+    }
+    src << "} i = i + 1; } return s; }\n";
+    src << "fn consts() { x = 0;\n";
+    for (int i = 0; i < 270000; ++i) {
+        src << "x = " << 1000000 + i << ";\n";
+    }
+    src << "return x; }\n";
+    src << "fn wide() {\n";
+    for (int i = 0; i < 300; ++i) {
+        src << "v" << i << " = " << i << ";\n";
+    }
+    src << "return v299 - v0 + big(2); }\n";
+    src << "fn main() { if (wide() != 140299) throw(); if (consts() != 1269999) throw(); return 0; }\n";
+    // same as compile_program, without printing a million instructions
+    auto &vm = initVM();
+    vm.gc.cleanup();
+    parser::init_parser(src, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    ASSERT_TRUE(parser::get_errors().empty());
+    ASSERT_NO_THROW(interpreter::run(true));
+    ASSERT_TRUE(vm.call_stack.empty());
+    ASSERT_EQ(vm.stack[0].i32, 0);
+}
+
+TEST(SimpleCompileFromFileOk, TestParallelInstances) {
+    // every thread parses and runs the program in a VM of its own
+    constexpr int threads_count = 4;
+    std::atomic<int> passed = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threads_count; ++t) {
+        threads.emplace_back([&passed] {
+            try {
+                std::ifstream fin("../../tests/sources/test_quicksort.ct");
+                auto vm = std::make_unique<VMData>();
+                BytecodeEmitter emitter;
+                parser::init_parser(fin, &emitter, *vm);
+                parser::parse_program(*vm);
+                if (!parser::get_errors().empty()) return;
+                interpreter::run(*vm);
+                if (vm->call_stack.empty() && vm->stack[0].is_nil()) passed++;
+            } catch (std::exception &e) {
+                std::cerr << e.what() << std::endl;
+            }
+        });
+    }
+    for (auto &thread: threads) thread.join();
+    ASSERT_EQ(passed, threads_count);
+}
+
+TEST(SimpleCompileFromFileOk, TestReusedInstance) {
+    // one VM runs several programs, reset() between them
+    auto vm = std::make_unique<VMData>();
+    for (const char *file: {"../../tests/sources/test_quicksort.ct", "../../tests/sources/test_tail_calls.ct",
+                            "../../tests/sources/test_quicksort.ct"}) {
+        interpreter::reset(*vm);
+        ASSERT_EQ(vm->instructions, 0u);
+        ASSERT_EQ(vm->gc.live_objects(), 0u);
+        std::ifstream fin(file);
+        BytecodeEmitter emitter;
+        parser::init_parser(fin, &emitter, *vm);
+        ASSERT_NO_THROW(parser::parse_program(*vm));
+        ASSERT_TRUE(parser::get_errors().empty());
+        ASSERT_NO_THROW(interpreter::run(*vm));
+        ASSERT_TRUE(vm->call_stack.empty());
+        ASSERT_GT(vm->instructions, 0u);
+    }
+}
+
+TEST(SimpleCompileFromFileOk, TestNoGcWithoutAllocation) {
+    // collections follow allocation, a loop that does not allocate never stops for one
+    std::stringstream src;
+    src << "fn main() { s = 0; for (i = 0; i < 100000; i += 1) { s += i % 7; } if (s != 299995) throw(); return 0; }";
+    auto vm = std::make_unique<VMData>();
+    vm->jit_on = false;
+    BytecodeEmitter emitter;
+    parser::init_parser(src, &emitter, *vm);
+    ASSERT_NO_THROW(parser::parse_program(*vm));
+    ASSERT_TRUE(parser::get_errors().empty());
+    ASSERT_NO_THROW(interpreter::run(*vm));
+    ASSERT_TRUE(vm->call_stack.empty());
+    ASSERT_GT(vm->instructions, 100000u);
+    ASSERT_EQ(vm->gc.stats.minor + vm->gc.stats.major + vm->gc.stats.large, 0u);
+}
+
+TEST(SimpleCompileFromFileOk, TestStackMap) {
+    ASSERT_NO_THROW({
+        std::ifstream fin("../../tests/sources/gc/test_stack_map.ct" );
+        return compile_program(fin);
+        });
+}
+
+TEST(SimpleCompileFromFileOk, TestLateMain) {
+    // main is called with a function index that does not fit into a
+    std::stringstream src;
+    for (int i = 0; i < 300; ++i) {
+        src << "fn f" << i << "(x) { return x + " << i << "; }\n";
+    }
+    src << "fn main() { return f299(1) + f0(2); }\n";
+    auto &vm = initVM();
+    parser::init_parser(src, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    ASSERT_TRUE(parser::get_errors().empty());
+    ASSERT_GT(vm.functions.size(), interpreter::A_ARG + 1);
+    ASSERT_NO_THROW(interpreter::run(true));
+    ASSERT_TRUE(vm.call_stack.empty());
+    ASSERT_EQ(vm.stack[0].i32, 302);
+}
+
 TEST(SimpleCompileFromFileOk, Test3) {
     ASSERT_NO_THROW({
                         std::ifstream fin("../../tests/sources/test3.ct");
@@ -2,6 +2,8 @@
 // Created by Георгий on 21.06.2025.
 //
 
+#include <chrono>
+#include <thread>
 #include <utility>
 
 #include "utils.h"
@@ -31,13 +33,38 @@ TEST(gc_test, OldArenaNoPromoting) {
     ASSERT_EQ(vm.gc.young_roots.size(), 1);
 
     auto *young = vm.gc.young_roots[0];
-    auto *from_stack = heap::mem.at(vm.stack[1].object_ptr);
+    auto *from_stack = vm.gc.resolve(vm.stack[1].object_ptr);
 
     ASSERT_EQ(young, from_stack);
 }
 
+TEST(gc_test, MaplessFrameDropsStaleSlots) {
+    VMData &vm = initVM();
+    vm.call_stack.clear();
+    // function 0 is hand-written, so it has no stack map
+    vm.code = {opcode(OP_HALT, 0, 0, 0)};
+    vm.functions[0].code_size = 1;
+    vm.functions[0].max_stack = 8;
+    run(vm);
+
+    // an array left in a register of a frame that has returned
+    vm.fp = 0;
+    vm.stack[0].set_int(3);
+    op_alloc(vm, 5, 0);
+    ASSERT_EQ(vm.gc.young_roots.size(), 1u);
+
+    // the callee frame covers the stale register
+    op_call(vm, 0, 4, 0);
+    ASSERT_EQ(vm.fp, 4u);
+    vm.gc.minor_gc();
+    EXPECT_TRUE(vm.stack[5].is_nil());
+    EXPECT_TRUE(vm.gc.old_roots.empty());
+
+    vm.call_stack.clear();
+    vm.fp = 0;
+}
+
 TEST(gc_test, LargeTest) {
-    heap::mem.clear();
     auto gc = heap::GarbageCollector<5>();
     ASSERT_TRUE(gc.young_roots.size() == 0);
     ASSERT_TRUE(gc.large_roots.empty());
@@ -48,7 +75,6 @@ TEST(gc_test, LargeTest) {
 }
 
 TEST(gc_test, YoungVsLarge) {
-    heap::mem.clear();
     auto gc = heap::GarbageCollector<5>();  // YOUNG_THRESHOLD = 5
 
     // 1) Массив len=3 → len+1=4 < 5 → young
@@ -62,6 +88,353 @@ TEST(gc_test, YoungVsLarge) {
     EXPECT_EQ(gc.young_roots.size(), 1u);
 }
 
+TEST(gc_test, PromotionFixesReferences) {
+    auto gc = heap::GarbageCollector<8>();
+    Value stack[4];
+    CallStack call_stack(4);
+    uint32_t fp = 2; // the roots are stack[0..2)
+    gc.init(stack, &call_stack, &fp);
+
+    auto *a = gc.alloc_array(3);
+    stack[0].set_array(3, a);
+    auto *large = gc.alloc_array(10);
+    stack[1].set_array(10, large);
+    large[1] = stack[0];
+    gc.write_barrier(gc.cage.offset_of(large + 1), large[1]); // as op_arrset does
+    auto *b = gc.alloc_array(2);
+    a[1].set_array(2, b); // b is reachable only through a
+    ASSERT_TRUE(decltype(gc)::is_young(stack[0].object_ptr));
+
+    gc.alloc_array(3); // the nursery is full, a and b are promoted
+    ASSERT_EQ(gc.stats.minor, 1u);
+    ASSERT_EQ(gc.old_roots.size(), 2u);
+    const uint32_t a_ptr = stack[0].object_ptr;
+    ASSERT_FALSE(decltype(gc)::is_young(a_ptr));
+    ASSERT_EQ(large[1].object_ptr, a_ptr);
+    auto *a_old = gc.resolve(a_ptr);
+    ASSERT_EQ(a_old->object_ptr, a_ptr);
+    ASSERT_EQ(a_old->get_len(), 3u);
+    ASSERT_FALSE(decltype(gc)::is_young(a_old[1].object_ptr));
+    ASSERT_EQ(gc.resolve(a_old[1].object_ptr)->get_len(), 2u);
+
+    // freed offsets are handed out again
+    stack[0].set_nil();
+    large[1].set_nil();
+    gc.major_gc();
+    ASSERT_TRUE(gc.old_roots.empty());
+    stack[0].set_array(3, gc.alloc_array(3)); // collects the one left in the nursery
+    gc.alloc_array(3);
+    ASSERT_EQ(gc.stats.minor, 3u);
+    ASSERT_EQ(stack[0].object_ptr, a_ptr);
+}
+
+TEST(gc_test, MinorGcCopiesCyclesOnce) {
+    auto gc = heap::GarbageCollector<16>();
+    Value stack[1];
+    CallStack call_stack(1);
+    uint32_t fp = 1;
+    gc.init(stack, &call_stack, &fp);
+
+    auto *a = gc.alloc_array(1);
+    auto *b = gc.alloc_array(2);
+    a[1].set_array(2, b);
+    b[1].set_array(1, a);
+    b[2].set_array(1, a);
+    stack[0].set_array(1, a);
+
+    gc.minor_gc();
+    ASSERT_EQ(gc.old_roots.size(), 2u);
+    auto *a_old = gc.resolve(stack[0].object_ptr);
+    auto *b_old = gc.resolve(a_old[1].object_ptr);
+    ASSERT_EQ(b_old->get_len(), 2u);
+    ASSERT_EQ(b_old[1].object_ptr, stack[0].object_ptr);
+    ASSERT_EQ(b_old[2].object_ptr, stack[0].object_ptr);
+    ASSERT_EQ(gc.young_alloc.get_used(), 0);
+}
+
+// reference to the array with header hdr
+Value array_ref(Value *hdr) {
+    Value res;
+    res.set_array(hdr->get_len(), hdr);
+    return res;
+}
+
+// old array placed directly in the cage, big graphs are built without a collection per nursery
+template<class GC>
+Value *old_array(GC &gc, uint32_t len) {
+    const auto obj_ptr = gc.cage.allocate(len + 1);
+    auto *ptr = gc.resolve(obj_ptr);
+    ptr->object_ptr = obj_ptr;
+    ptr->set_array(len, ptr);
+    for (uint32_t i = 1; i < len + 1; ++i) {
+        ptr[i].set_nil();
+    }
+    gc.old_roots.push_back(obj_ptr);
+    gc.old_values += len + 1;
+    return ptr;
+}
+
+// n nodes {next, index}, returns the head
+template<class GC>
+Value *linked_list(GC &gc, int n) {
+    Value *head = nullptr;
+    for (int i = 0; i < n; ++i) {
+        auto *node = old_array(gc, 2);
+        if (head) node[1] = array_ref(head);
+        node[2].set_int(i);
+        head = node;
+    }
+    return head;
+}
+
+// fanout children per node, depth levels below the root
+template<class GC>
+Value *wide_tree(GC &gc, int fanout, int depth) {
+    if (depth == 0) return old_array(gc, 0);
+    auto *node = old_array(gc, fanout);
+    for (int i = 1; i < fanout + 1; ++i) {
+        node[i] = array_ref(wide_tree(gc, fanout, depth - 1));
+    }
+    return node;
+}
+
+TEST(gc_test, MarkStackOverflowRescans) {
+    auto gc = heap::GarbageCollector<8>();
+    Value stack[2];
+    CallStack call_stack(1);
+    uint32_t fp = 2;
+    gc.init(stack, &call_stack, &fp);
+    gc.mark_stack_limit = 4;
+
+    stack[0] = array_ref(wide_tree(gc, 10, 3));
+    stack[1] = array_ref(linked_list(gc, 1000));
+    const auto alive = gc.old_roots.size();
+    linked_list(gc, 100); // garbage
+
+    gc.major_gc();
+    ASSERT_EQ(gc.old_roots.size(), alive);
+    gc.for_each_object([&gc](Value *ptr) { ASSERT_FALSE(gc.is_marked(gc.cage.offset_of(ptr))); });
+}
+
+TEST(gc_test, MinorGcTracesDirtyCards) {
+    auto gc = heap::GarbageCollector<8>();
+    Value stack[1];
+    CallStack call_stack(1);
+    uint32_t fp = 1;
+    gc.init(stack, &call_stack, &fp);
+
+    auto *old = old_array(gc, 100);
+    stack[0] = array_ref(old);
+    old_array(gc, 100); // old garbage, a minor gc leaves it alone
+    auto *young = gc.alloc_array(2);
+    old[50] = array_ref(young);
+    gc.write_barrier(gc.cage.offset_of(old + 50), old[50]);
+    ASSERT_EQ(gc.dirty_cards.size(), 1u);
+    gc.alloc_array(1); // young garbage
+
+    gc.minor_gc();
+    ASSERT_TRUE(gc.dirty_cards.empty());
+    ASSERT_EQ(gc.old_roots.size(), 3u);
+    ASSERT_FALSE(decltype(gc)::is_young(old[50].object_ptr));
+    ASSERT_EQ(gc.resolve(old[50].object_ptr)->get_len(), 2u);
+    // the old generation was not traced
+    gc.for_each_object([&gc](Value *ptr) { ASSERT_FALSE(gc.is_marked(gc.cage.offset_of(ptr))); });
+}
+
+TEST(gc_test, MajorGcCompactsFragmentedHeap) {
+    auto gc = heap::GarbageCollector<16>();
+    Value stack[2];
+    CallStack call_stack(1);
+    uint32_t fp = 2;
+    gc.init(stack, &call_stack, &fp);
+
+    // live list nodes {next, index, ...} of mixed sizes, each followed by a dead array
+    Value *head = nullptr;
+    for (int i = 0; i < 2000; ++i) {
+        auto *node = old_array(gc, 2 + i % 7);
+        if (head) node[1] = array_ref(head);
+        node[2].set_int(i);
+        head = node;
+        old_array(gc, 10);
+    }
+    stack[0] = array_ref(head);
+    auto *large = gc.alloc_array(100);
+    large[100] = stack[0];
+    stack[1] = array_ref(large);
+    gc.alloc_array(100); // dead
+    const auto top = gc.cage.top();
+
+    gc.major_gc();
+    ASSERT_EQ(gc.stats.compactions, 1u);
+    ASSERT_GT(gc.stats.fragmentation_before, 0.5);
+    ASSERT_EQ(gc.stats.fragmentation_after, 0.0);
+    ASSERT_LT(gc.cage.top(), top);
+    ASSERT_EQ(gc.old_roots.size(), 2000u);
+    ASSERT_EQ(gc.large_roots.size(), 1u);
+    // the dead large array no longer counts towards the next large gc
+    ASSERT_EQ(gc.large_values, 101u);
+    ASSERT_EQ(gc.large_limit, gc.next_limit(101, gc.LARGE_MIN_BUDGET));
+
+    auto *large_moved = gc.resolve(stack[1].object_ptr);
+    ASSERT_EQ(large_moved, gc.large_roots[0]);
+    ASSERT_EQ(large_moved[100].object_ptr, stack[0].object_ptr);
+    Value node = stack[0];
+    for (int i = 1999; i >= 0; --i) {
+        auto *ptr = gc.resolve(node.object_ptr);
+        ASSERT_EQ(ptr->object_ptr, node.object_ptr);
+        ASSERT_EQ(ptr->get_len(), 2u + i % 7);
+        ASSERT_EQ(ptr[2].i32, i);
+        node = ptr[1];
+    }
+    ASSERT_TRUE(node.is_nil());
+    gc.for_each_object([&gc](Value *ptr) { ASSERT_FALSE(gc.is_marked(gc.cage.offset_of(ptr))); });
+}
+
+TEST(gc_test, IncrementalMarkingKeepsBarrierStores) {
+    auto gc = heap::GarbageCollector<16>();
+    Value stack[2];
+    CallStack call_stack(1);
+    uint32_t fp = 2;
+    gc.init(stack, &call_stack, &fp);
+    gc.incremental = true;
+    gc.pause_budget = std::chrono::nanoseconds(0); // 64 objects a step
+
+    auto *head = linked_list(gc, 10000);
+    stack[0] = array_ref(head);
+    auto *moved = old_array(gc, 1); // reachable from the stack only
+    stack[1] = array_ref(moved);
+    for (int i = 0; i < 10; ++i) old_array(gc, 3); // garbage
+
+    gc.major_gc();
+    ASSERT_TRUE(gc.marking);
+    ASSERT_TRUE(gc.is_marked(gc.cage.offset_of(head)));
+    // moved goes from the stack to the black head, only the barrier keeps it alive
+    head[2] = stack[1];
+    gc.write_barrier(gc.cage.offset_of(head + 2), head[2]);
+    stack[1].set_nil();
+    while (gc.marking) {
+        gc.mark_step();
+    }
+
+    ASSERT_GT(gc.stats.mark_steps, 100u);
+    ASSERT_EQ(gc.stats.major, 1u);
+    ASSERT_EQ(gc.old_roots.size(), 10001u);
+    ASSERT_EQ(gc.resolve(head[2].object_ptr), moved);
+    ASSERT_EQ(moved->object_ptr, gc.cage.offset_of(moved));
+    gc.for_each_object([&gc](Value *ptr) { ASSERT_FALSE(gc.is_marked(gc.cage.offset_of(ptr))); });
+}
+
+TEST(gc_test, MajorGcFollowsPromotedVolume) {
+    auto gc = heap::GarbageCollector<8>();
+    Value stack[1];
+    CallStack call_stack(1);
+    uint32_t fp = 1;
+    gc.init(stack, &call_stack, &fp);
+    gc.MAJOR_MIN_BUDGET = 32;
+
+    // every allocation after the first fills the nursery and promotes the previous array, 4 Values
+    for (int i = 0; i < 25; ++i) {
+        stack[0].set_array(3, gc.alloc_array(3));
+    }
+    ASSERT_EQ(gc.stats.minor, 24u);
+    // at 32 promoted Values, then 32 above the 4 that survive each major gc
+    ASSERT_EQ(gc.stats.major, 3u);
+    ASSERT_EQ(gc.old_limit, 36u);
+    ASSERT_EQ(gc.old_values, 4u);
+
+    // a big survivor sets the limit by the growth factor
+    auto *kept = old_array(gc, 99);
+    stack[0] = array_ref(kept);
+    gc.major_gc();
+    ASSERT_EQ(gc.old_values, 100u);
+    ASSERT_EQ(gc.old_limit, 200u);
+}
+
+TEST(gc_test, PollFinishesIncrementalCycle) {
+    auto gc = heap::GarbageCollector<16>();
+    Value stack[1];
+    CallStack call_stack(1);
+    uint32_t fp = 1;
+    gc.init(stack, &call_stack, &fp);
+    gc.incremental = true;
+    gc.pause_budget = std::chrono::nanoseconds(0);
+    ASSERT_FALSE(gc.poll_pending);
+
+    stack[0] = array_ref(linked_list(gc, 1000));
+    for (int i = 0; i < 10; ++i) old_array(gc, 3); // garbage
+    gc.call();
+    // no allocation follows, the back-edges of the program finish the cycle
+    ASSERT_TRUE(gc.poll_pending);
+    while (gc.poll_pending) {
+        gc.poll();
+    }
+    ASSERT_FALSE(gc.marking);
+    ASSERT_GT(gc.stats.mark_steps, 10u);
+    ASSERT_EQ(gc.old_roots.size(), 1000u);
+    ASSERT_EQ(gc.old_values, 3000u);
+}
+
+TEST(gc_test, ParallelMarkKeepsReachable) {
+    auto gc = heap::GarbageCollector<16>();
+    Value stack[3];
+    CallStack call_stack(1);
+    uint32_t fp = 3;
+    gc.init(stack, &call_stack, &fp);
+    gc.mark_threads = 4;
+    gc.PARALLEL_MIN_OBJECTS = 0;
+
+    stack[0] = array_ref(wide_tree(gc, 20, 3));
+    stack[1] = array_ref(linked_list(gc, 5000));
+    auto *cycle = old_array(gc, 1);
+    cycle[1] = array_ref(cycle);
+    stack[2] = array_ref(cycle);
+    const auto alive = gc.old_roots.size();
+    for (int i = 0; i < 1000; ++i) old_array(gc, 2); // garbage
+
+    gc.major_gc();
+    ASSERT_EQ(gc.old_roots.size(), alive);
+    gc.for_each_object([&gc](Value *ptr) { ASSERT_FALSE(gc.is_marked(gc.cage.offset_of(ptr))); });
+}
+
+using PerfomanceGcMark = Test;
+
+// runs a major gc over the graph rooted at stack[0], every object of it survives
+template<class GC>
+void measure_mark(GC &gc, Value root, const char *name) {
+    Value stack[1] = {root};
+    CallStack call_stack(1);
+    uint32_t fp = 1;
+    gc.init(stack, &call_stack, &fp);
+    const auto objects = gc.old_roots.size();
+
+    auto t1 = std::chrono::high_resolution_clock::now();
+    gc.major_gc();
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << name << ", " << objects << " objects: "
+              << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() << " us\n";
+    ASSERT_EQ(gc.old_roots.size(), objects);
+
+    stack[0].set_nil();
+    gc.major_gc();
+    ASSERT_TRUE(gc.old_roots.empty());
+}
+
+TEST(PerfomanceGcMark, LinkedList) {
+    auto gc = heap::GarbageCollector<200>();
+    measure_mark(gc, array_ref(linked_list(gc, 1'000'000)), "linked list");
+}
+
+TEST(PerfomanceGcMark, WideTree) {
+    auto gc = heap::GarbageCollector<200>();
+    measure_mark(gc, array_ref(wide_tree(gc, 100, 3)), "wide tree");
+}
+
+TEST(PerfomanceGcMark, WideTreeParallel) {
+    auto gc = heap::GarbageCollector<200>();
+    gc.mark_threads = std::max(4u, std::thread::hardware_concurrency());
+    measure_mark(gc, array_ref(wide_tree(gc, 100, 3)), "wide tree, parallel");
+}
+
 // TEST(gc_test, LargeGcEvictsUnmarked) {
 //     heap::mem.clear();
 //     auto gc = heap::GarbageCollector<5>();
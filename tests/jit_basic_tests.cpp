@@ -18,9 +18,9 @@ TEST(SimpleJitTest, TestAdd) {
     vm.constanti.push_back(v);
     v.set_int(3);
     vm.constanti.push_back(v);
-    vm.code[vm.code_size++] = opcode(OP_ADD, 2, 0, 1);
-    vm.code[vm.code_size++] = opcode(OP_RETURN, 2, 0, 0);
-    vm.functions[0].code_size = vm.code_size;
+    vm.code.push_back(opcode(OP_ADD, 2, 0, 1));
+    vm.code.push_back(opcode(OP_RETURN, 2, 0, 0));
+    vm.functions[0].code_size = vm.code.size();
     asmjit::JitRuntime jt;
     jit::JitRuntime rt;
     jit::FuncCompiled func;
@@ -63,9 +63,9 @@ TEST(SimpleJitTest, TestSub) {
     vm.constanti.push_back(v);
     v.set_int(3);
     vm.constanti.push_back(v);
-    vm.code[vm.code_size++] = opcode(OP_SUB, 2, 0, 1);
-    vm.code[vm.code_size++] = opcode(OP_RETURN, 2, 0, 0);
-    vm.functions[0].code_size = vm.code_size;
+    vm.code.push_back(opcode(OP_SUB, 2, 0, 1));
+    vm.code.push_back(opcode(OP_RETURN, 2, 0, 0));
+    vm.functions[0].code_size = vm.code.size();
     asmjit::JitRuntime jt;
     jit::JitRuntime rt;
     jit::FuncCompiled func;
@@ -106,9 +106,9 @@ TEST(SimpleJitTest, TestMul) {
     vm.constanti.push_back(v);
     v.set_int(3);
     vm.constanti.push_back(v);
-    vm.code[vm.code_size++] = opcode(OP_MUL, 2, 0, 1);
-    vm.code[vm.code_size++] = opcode(OP_RETURN, 2, 0, 0);
-    vm.functions[0].code_size = vm.code_size;
+    vm.code.push_back(opcode(OP_MUL, 2, 0, 1));
+    vm.code.push_back(opcode(OP_RETURN, 2, 0, 0));
+    vm.functions[0].code_size = vm.code.size();
     asmjit::JitRuntime jt;
     jit::JitRuntime rt;
     jit::FuncCompiled func;
@@ -149,9 +149,9 @@ TEST(SimpleJitTest, TestDiv) {
     vm.constanti.push_back(v);
     v.set_int(3);
     vm.constanti.push_back(v);
-    vm.code[vm.code_size++] = opcode(OP_DIV, 2, 0, 1);
-    vm.code[vm.code_size++] = opcode(OP_RETURN, 2, 0, 0);
-    vm.functions[0].code_size = vm.code_size;
+    vm.code.push_back(opcode(OP_DIV, 2, 0, 1));
+    vm.code.push_back(opcode(OP_RETURN, 2, 0, 0));
+    vm.functions[0].code_size = vm.code.size();
     asmjit::JitRuntime jt;
     jit::JitRuntime rt;
     jit::FuncCompiled func;
@@ -217,9 +217,9 @@ TEST(SimpleJitTest, TestModulo) {
     vm.constanti.push_back(v);
     v.set_int(3);
     vm.constanti.push_back(v);
-    vm.code[vm.code_size++] = opcode(OP_MOD, 2, 0, 1);
-    vm.code[vm.code_size++] = opcode(OP_RETURN, 2, 0, 0);
-    vm.functions[0].code_size = vm.code_size;
+    vm.code.push_back(opcode(OP_MOD, 2, 0, 1));
+    vm.code.push_back(opcode(OP_RETURN, 2, 0, 0));
+    vm.functions[0].code_size = vm.code.size();
     asmjit::JitRuntime jt;
     jit::JitRuntime rt;
     jit::FuncCompiled func;
@@ -477,7 +477,7 @@ INSTANTIATE_TEST_SUITE_P(
                           }, [](Value *stack) {
                               stack[0].set_float(1.0f);
                               stack[1].set_float(2.0f);
-                          }, fromInt(0)
+                          }, fromInt(1)
                ),
                make_tuple([](BytecodeEmitter &emitter) {
                               std::cout << "load less(false, float, equal)\n";
@@ -557,7 +557,7 @@ INSTANTIATE_TEST_SUITE_P(
                           }, [](Value *stack) {
                               stack[0].set_float(1.0f);
                               stack[1].set_float(2.0f);
-                          }, fromInt(0)
+                          }, fromInt(1)
                ),
                make_tuple([](BytecodeEmitter &emitter) {
                               std::cout << "load leq(true, float, equal)\n";
@@ -728,7 +728,128 @@ INSTANTIATE_TEST_SUITE_P(
                }, [](Value *stack) {
                    stack[0].set_nil();
                    stack[1].set_nil();
-               }, *reinterpret_cast<const Value *>(&OBJ_NIL))
+               }, *reinterpret_cast<const Value *>(&OBJ_NIL)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "jlt\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_jmp_label(OP_JLT, 0, 1, 0);
+                   emitter.emit_retnil();
+                   emitter.label(0);
+                   emitter.emit_return(1);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(-3);
+                   stack[1].set_int(10);
+               }, fromInt(10)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "jnle(do not jmp)\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_jmp_label(OP_JNLE, 0, 1, 0);
+                   emitter.emit_return(1);
+                   emitter.label(0);
+                   emitter.emit_retnil();
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_float(2.5f);
+                   stack[1].set_float(2.5f);
+               }, fromFloat(2.5f)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "jnlt(float)\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_jmp_label(OP_JNLT, 0, 1, 0);
+                   emitter.emit_retnil();
+                   emitter.label(0);
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_float(3.0f);
+                   stack[1].set_float(2.0f);
+               }, fromFloat(3.0f)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "jeq\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_jmp_label(OP_JEQ, 0, 1, 0);
+                   emitter.emit_retnil();
+                   emitter.label(0);
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(7);
+                   stack[1].set_int(7);
+               }, fromInt(7)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "jle(fail, different types)\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_jmp_label(OP_JLE, 0, 1, 0);
+                   emitter.emit_retnil();
+                   emitter.label(0);
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(1);
+                   stack[1].set_float(2.0f);
+               }, *reinterpret_cast<const Value *>(&TEST_BAD_NIL)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "addi\n";
+                   emitter.begin_func(0, "main");
+                   emitter.emit_arith_imm(OP_SUBI, 0, 0, -7);
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(5);
+               }, fromInt(12)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "mulk(float)\n";
+                   emitter.begin_func(0, "main");
+                   Value k;
+                   k.set_float(1.5f);
+                   emitter.emit_arith_k(OP_MULK, 0, 0, emitter.kconstant(k));
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_float(3.0f);
+               }, fromFloat(4.5f)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "lti(negated)\n";
+                   emitter.begin_func(0, "main");
+                   emitter.cmp_imm_jmp_label(OP_LTI, 0, 100, true, 0);
+                   emitter.emit_retnil();
+                   emitter.label(0);
+                   emitter.emit_return(0);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(100);
+               }, fromInt(100)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "self tailcall\n";
+                   emitter.begin_func(2, "main");
+                   emitter.cmp_imm_jmp_label(OP_EQI, 0, 0, false, 0);
+                   emitter.emit_loadfunc(2, 0);
+                   emitter.emit_arith_imm(OP_SUBI, 3, 0, 1);
+                   emitter.emit_add(4, 1, 0);
+                   emitter.emit_tailcall(2, 3, 2);
+                   emitter.label(0);
+                   emitter.emit_return(1);
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_int(100000);
+                   stack[1].set_int(0);
+               }, fromInt(705082704)),
+               make_tuple([](BytecodeEmitter &emitter) {
+                   std::cout << "wide registers\n";
+                   emitter.begin_func(0, "main");
+                   emitter.emit_loadi(300, 7);
+                   emitter.emit_loadi(1, 5);
+                   emitter.emit_add(400, 300, 1);
+                   emitter.jmpf_label(400, 0);
+                   emitter.emit_arith_imm(OP_ADDI, 511, 400, 30);
+                   emitter.emit_return(511);
+                   emitter.label(0);
+                   emitter.emit_retnil();
+                   emitter.end_func();
+               }, [](Value *stack) {
+                   stack[0].set_nil();
+               }, fromInt(42))
         )
 );
 
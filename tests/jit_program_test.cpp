@@ -1,6 +1,7 @@
 //
 // Created by motya on 27.06.2025.
 //
+#include <algorithm>
 #include "utils.h"
 #include "src/ast.h"
 #include "src/jit_runtime.h"
@@ -15,7 +16,7 @@ void test_jit1(std::istream &fin, Value res) {
     parser::init_parser(fin, new BytecodeEmitter());
     ASSERT_NO_THROW(parser::parse_program(vm));
     print_vm_data(vm);
-    for (int i = 0; i < vm.functions_count; ++i) {
+    for (size_t i = 0; i < vm.functions.size(); ++i) {
         vm.functions[i].hotness = 100;
     }
     vm.jit_log_level = 1;
@@ -55,6 +56,119 @@ TEST(ProgramJitTest, TestArrGet) {
     //set stack
 }
 
+TEST(ProgramJitTest, TestPromotedRegisters) {
+    std::ifstream fin("../../tests/sources/jit_promoted.ct");
+    Value v;
+    v.set_int(20 * 499500);
+    test_jit1(fin, v);
+}
+
+TEST(ProgramJitTest, TestCalls) {
+    std::ifstream fin("../../tests/sources/jit_calls.ct");
+    Value v;
+    v.set_int(328350 + 2025 + 6765);
+    test_jit1(fin, v);
+    for (auto &f: vm_instance().functions) {
+        ASSERT_NE(f.jitted, nullptr);
+    }
+}
+
+TEST(ProgramJitTest, TestDeepRecursion) {
+    interpreter::set_jit_on();
+    std::ifstream fin("../../tests/sources/jit_deep_recursion.ct");
+    Value v;
+    v.set_int(1000000 + 20000);
+    test_jit1(fin, v);
+    ASSERT_EQ(vm_instance().native_depth, 0);
+}
+
+TEST(ProgramJitTest, TestRecursionOverflow) {
+    interpreter::set_jit_on();
+    std::stringstream fin("fn inf(n) { return inf(n + 1) + 1; } fn main() { return inf(0); }");
+    auto &vm = initVM();
+    parser::init_parser(fin, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    vm.functions[0].hotness = 100;
+    vm.jit_log_level = 0;
+    ASSERT_THROW(interpreter::run(), std::runtime_error);
+    ASSERT_NE(vm.functions[0].jitted, nullptr);
+    ASSERT_EQ(vm.native_depth, 0);
+}
+
+// jitted code cannot unwind, the error of its runtime call leaves the jitted frames and is thrown past them
+void test_jit_throws(const std::string &source) {
+    interpreter::set_jit_on();
+    std::stringstream fin(source);
+    auto &vm = initVM();
+    parser::init_parser(fin, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    vm.jit_log_level = 0;
+    ASSERT_THROW(interpreter::run(), std::exception);
+    ASSERT_NE(vm.functions[0].jitted, nullptr);
+    ASSERT_EQ(vm.native_depth, 0);
+    ASSERT_EQ(vm.pending, nullptr);
+}
+
+TEST(ProgramJitTest, TestArrayIndexThrows) {
+    test_jit_throws("fn get(a, i) { return a[i]; } "
+                    "fn main() { a = array(3); a[1] = 2; s = 0; "
+                    "for (i = 0; i < 20; i += 1) { s += get(a, 1); } return get(a, 5); }");
+}
+
+TEST(ProgramJitTest, TestArraySetThrows) {
+    test_jit_throws("fn put(a, i) { a[i] = i; return 0; } "
+                    "fn main() { a = array(3); for (i = 0; i < 20; i += 1) { put(a, 1); } return put(a, 5); }");
+}
+
+TEST(ProgramJitTest, TestNativeThrows) {
+    test_jit_throws("fn check(x) { if (x > 100) { throw(); } return x; } "
+                    "fn main() { s = 0; for (i = 0; i < 20; i += 1) { s += check(i); } return check(1000); }");
+}
+
+TEST(ProgramJitTest, TestNegativeZeroIsFalse) {
+    interpreter::set_jit_on();
+    std::ifstream fin("../../tests/sources/jit_negative_zero.ct");
+    Value v;
+    v.set_int(0);
+    test_jit1(fin, v);
+}
+
+TEST(ProgramJitTest, TestSpeculatedTypes) {
+    std::ifstream fin("../../tests/sources/jit_speculation.ct");
+    auto &vm = initVM();
+    parser::init_parser(fin, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    // the functions warm up in the interpreter, which quickens the instructions it ran
+    interpreter::set_jit_on();
+    vm.jit_log_level = 1;
+    interpreter::run();
+    Value v;
+    v.set_int(400);
+    ASSERT_EQ(vm.stack[0].as_uint64(), v.as_uint64());
+    auto acc = std::find_if(vm.functions.begin(), vm.functions.end(),
+                            [](const Function &f) { return f.arity == 2; });
+    ASSERT_NE(acc, vm.functions.end());
+    ASSERT_EQ(acc->deopts, DEOPT_LIMIT);
+    ASSERT_NE(acc->jitted, nullptr);
+}
+
+TEST(ProgramJitTest, TestDeoptInLoop) {
+    std::ifstream fin("../../tests/sources/jit_deopt.ct");
+    auto &vm = initVM();
+    parser::init_parser(fin, new BytecodeEmitter());
+    ASSERT_NO_THROW(parser::parse_program(vm));
+    interpreter::set_jit_on();
+    vm.jit_log_level = 1;
+    interpreter::run();
+    Value v;
+    v.set_int(13 * 1000);
+    ASSERT_EQ(vm.stack[0].as_uint64(), v.as_uint64());
+    auto count = std::find_if(vm.functions.begin(), vm.functions.end(),
+                              [](const Function &f) { return f.arity == 2; });
+    ASSERT_NE(count, vm.functions.end());
+    ASSERT_EQ(count->deopts, 1u);
+}
+
 TEST(ProgramJitTest, Test2) {
     std::ifstream tempf("any.txt");
     auto emitter = BytecodeEmitter();
@@ -82,6 +196,55 @@ TEST(ProgramJitTest, Test2) {
     ASSERT_EQ(func(vm_instance().stack), temp);
 }
 
+TEST(ProgramJitTest, TestDirectCall) {
+    std::ifstream tempf("any.txt");
+    auto &vm = initVM();
+    auto emitter = BytecodeEmitter();
+    parser::init_parser(tempf, &emitter);
+
+    const int sq = emitter.begin_func(1, "sq");
+    emitter.emit_mul(1, 0, 0);
+    emitter.emit_return(1);
+    emitter.end_func();
+
+    const int main = emitter.begin_func(0, "main");
+    emitter.emit_loadi(0, 0);
+    emitter.emit_loadi(1, 0);
+    emitter.emit_loadi(2, 1000);
+    emitter.label(0);
+    emitter.cmp_jmp_label(OP_JNLT, 1, 2, 1);
+    emitter.emit_move(3, 1);
+    emitter.emit_call_direct(sq, 3, 1);
+    emitter.emit_add(0, 0, 3);
+    emitter.emit_arith_imm(OP_ADDI, 1, 1, 1);
+    emitter.jmp_label(0);
+    emitter.label(1);
+    // sq was compiled for the ints it saw, a float deopts it under the jitted main
+    emitter.emit_loadf(3, 1.5f);
+    emitter.emit_call_direct(sq, 3, 1);
+    emitter.emit_loadf(4, 2.25f);
+    emitter.emit_eq(5, 3, 4);
+    emitter.jmpf_label(5, 2);
+    emitter.emit_return(0);
+    emitter.label(2);
+    emitter.emit_retnil();
+    emitter.end_func();
+    emitter.initVM(vm);
+
+    // main is compiled on its call, sq warms up in the interpreter under it
+    interpreter::set_jit_on();
+    vm.jit_log_level = 1;
+    vm.functions[main].hotness = 100;
+    interpreter::run();
+    Value v;
+    v.set_int(332833500);
+    ASSERT_EQ(vm.stack[0].as_uint64(), v.as_uint64());
+    ASSERT_NE(vm.functions[main].jitted, nullptr);
+    ASSERT_NE(vm.functions[sq].jitted, nullptr);
+    ASSERT_EQ(vm.functions[sq].deopts, 1u);
+    ASSERT_TRUE(vm.call_stack.empty());
+}
+
 using PerfomanceJitOnAndOff = Test;
 
 template<typename T>
@@ -124,7 +287,7 @@ void simple_perfomance_cmp(std::string filename) {
     interpreter::vm_instance().jit_log_level = 1;
     vm_instance().gc.cleanup();
     emitter->initVM(vm_instance());
-    for (int i = 0; i < vm_instance().functions_count; i++) {
+    for (size_t i = 0; i < vm_instance().functions.size(); i++) {
         vm_instance().functions[i].hotness = 100;
     }
     auto x = measure1([]() {
@@ -162,6 +325,39 @@ TEST(PerfomanceJitOnAndOff, Playground) {
 TEST(PerfomanceJitOnAndOff, Fact20) {
     simple_perfomance_cmp("../../tests/sources/test_fact20.ct");
 }
+
+using PerformanceDispatch = Test;
+
+// Runs the program with jit off under both dispatch modes of the interpreter loop
+void dispatch_perfomance_cmp(std::string filename) {
+    interpreter::set_jit_off();
+    auto emitter = test_jit_compile(filename);
+    auto run_with = [&](DispatchMode mode) {
+        interpreter::set_dispatch_mode(mode);
+        vm_instance().gc.cleanup();
+        emitter->initVM(vm_instance());
+        return measure1([]() {
+            interpreter::run();
+        });
+    };
+    //Warm up
+    run_with(DispatchMode::SWITCH);
+    auto y = run_with(DispatchMode::SWITCH);
+    auto x = run_with(DispatchMode::THREADED);
+    ASSERT_TRUE(vm_instance().call_stack.empty());
+    std::cout << "Results: switch:   " << y / 1000 << '.' << y % 1000 << std::endl;
+    std::cout << "         threaded: " << x / 1000 << '.' << x % 1000 << std::endl;
+    interpreter::set_dispatch_mode(DispatchMode::THREADED);
+    interpreter::set_jit_on();
+}
+
+TEST(PerformanceDispatch, Sort) {
+    dispatch_perfomance_cmp("../../tests/sources/test_quicksort.ct");
+}
+
+TEST(PerformanceDispatch, StupidCalculation) {
+    dispatch_perfomance_cmp("../../tests/sources/jitSimple2.ct");
+}
 /*
  constants: [2, 1, 0, 10]
 func0(args: 3):
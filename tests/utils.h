@@ -42,13 +42,13 @@ inline void print_vm_data(interpreter::VMData &vm) {
     }
     std::cout << "]\n";
     std::unordered_map<int, Function *> functions;
-    for (int i = 0; i < vm.functions_count; ++i) {
+    for (size_t i = 0; i < vm.functions.size(); ++i) {
         functions[vm.functions[i].entry_point] = &vm.functions[i];
     }
-    for (int i = 0; i < vm.code_size; ++i) {
+    for (size_t i = 0; i < vm.code.size(); ++i) {
         auto it = functions.find(i);
         if (it != functions.end()) {
-            std::cout << "func" << it->second - vm.functions << "(args: " << (int) it->second->arity << "):\n";
+            std::cout << "func" << it->second - vm.functions.data() << "(args: " << (int) it->second->arity << "):\n";
         }
         std::cout << "    " << interpreter::ins_to_string(vm.code[i], &vm.constanti, &vm.constantf);
         if (i == vm.ip) {
@@ -82,11 +82,15 @@ inline auto parse(const std::string &text, T func = parse_expression) {
 
 inline interpreter::VMData &initVM() {
     interpreter::VMData &vm = interpreter::vm_instance();
-    // vm.gc = heap::GarbageCollector();
+    // objects of earlier tests must not count against this one
+    vm.gc.cleanup();
 
     vm.ip = 0; // Start at first instruction
     vm.fp = 0; // Frame pointer at base
     vm.sp = 0; // Stack pointer
+    vm.call_stack.clear(); // frames a test that threw left behind
+    vm.code.clear();
+    vm.functions.assign(1, interpreter::Function{}); // hand-written bytecode goes to function 0
 
     return vm;
 }